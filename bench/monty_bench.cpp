@@ -0,0 +1,293 @@
+// monty_bench - measures how long montyc takes to compile the benchmark
+// programs at each optimization level and how fast the produced executables
+// run. Results are written as JSON and can be compared against a baseline.
+#include <chrono>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace cl = llvm::cl;
+
+static cl::opt<std::string> montyc("montyc", cl::desc("Path to montyc"),
+                                   cl::value_desc("path"), cl::Required);
+static cl::list<std::string> programs(cl::Positional, cl::OneOrMore,
+                                      cl::desc("<programs...>"));
+static cl::list<std::string> levels("levels", cl::CommaSeparated,
+                                    cl::desc("Optimization levels to measure "
+                                             "(default 0,1,2,3)"),
+                                    cl::value_desc("levels"));
+static cl::opt<unsigned>
+    repeat("repeat", cl::init(3),
+           cl::desc("Runs per measurement, the fastest one is kept"));
+static cl::opt<std::string> output("o", cl::init("-"),
+                                   cl::desc("Results file (default stdout)"),
+                                   cl::value_desc("path"));
+static cl::opt<std::string> baseline("baseline",
+                                     cl::desc("Results file to compare to"),
+                                     cl::value_desc("path"));
+static cl::opt<double>
+    tolerance("tolerance", cl::init(0.25),
+              cl::desc("Allowed slowdown relative to the baseline"));
+static cl::opt<double>
+    minTime("min-time", cl::init(0.05),
+            cl::desc("Slowdowns below this many seconds are ignored"));
+static cl::opt<std::string> workDir("work-dir",
+                                    cl::desc("Directory for the executables "
+                                             "(default: a temporary one)"),
+                                    cl::value_desc("dir"));
+static cl::opt<unsigned> timeout("timeout", cl::init(300),
+                                 cl::desc("Seconds before a run is aborted"));
+
+namespace {
+
+struct Result {
+  std::string program;
+  std::string level;
+  double compileWall = 0;
+  llvm::StringMap<double> phases;
+  int64_t vectorizedLoops = 0;
+  double runWall = 0;
+};
+
+double seconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+// Runs `args` and returns its wall time, or nothing if it did not succeed
+std::optional<double> timeProcess(llvm::ArrayRef<llvm::StringRef> args,
+                                  bool discardOutput) {
+  std::optional<llvm::StringRef> redirects[] = {std::nullopt, std::nullopt,
+                                                std::nullopt};
+  if (discardOutput)
+    redirects[1] = llvm::StringRef("/dev/null");
+
+  std::string error;
+  auto start = std::chrono::steady_clock::now();
+  int status = llvm::sys::ExecuteAndWait(args[0], args, std::nullopt,
+                                         redirects, timeout, 0, &error);
+  auto end = std::chrono::steady_clock::now();
+  if (status != 0) {
+    llvm::errs() << args[0] << " failed";
+    if (!error.empty())
+      llvm::errs() << ": " << error;
+    llvm::errs() << " (exit code " << status << ")\n";
+    return std::nullopt;
+  }
+  return seconds(end - start);
+}
+
+// Phase wall times and counts from the statistics file written by montyc
+bool readStatistics(llvm::StringRef path, Result &result) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer)
+    return false;
+  auto json = llvm::json::parse((*buffer)->getBuffer());
+  if (!json) {
+    llvm::consumeError(json.takeError());
+    return false;
+  }
+  const llvm::json::Object *root = json->getAsObject();
+  const llvm::json::Object *list = root ? root->getObject("phases") : nullptr;
+  if (!list)
+    return false;
+
+  result.phases.clear();
+  for (const auto &[name, value] : *list)
+    if (const llvm::json::Object *phase = value.getAsObject())
+      result.phases[name.str()] = phase->getNumber("wall").value_or(0);
+
+  if (const llvm::json::Object *counts = root->getObject("counts"))
+    result.vectorizedLoops =
+        counts->getInteger("vectorized_loops").value_or(0);
+  return true;
+}
+
+std::optional<Result> measure(llvm::StringRef program, llvm::StringRef level,
+                              llvm::StringRef dir) {
+  Result result;
+  result.program = llvm::sys::path::stem(program).str();
+  result.level = level.str();
+
+  llvm::SmallString<128> exe(dir);
+  llvm::sys::path::append(exe, result.program + "-O" + result.level);
+  std::string optFlag = "-O" + result.level;
+  std::string statsFile = (exe.str() + ".json").str();
+  std::string statsFlag = "--stats-json=" + statsFile;
+
+  llvm::StringRef compileArgs[] = {montyc, program, optFlag, "-o", exe,
+                                   statsFlag};
+  result.compileWall = -1;
+  for (unsigned i = 0; i < repeat; ++i) {
+    std::optional<double> wall = timeProcess(compileArgs, false);
+    if (!wall)
+      return std::nullopt;
+    if (result.compileWall >= 0 && *wall >= result.compileWall)
+      continue;
+    result.compileWall = *wall;
+    if (!readStatistics(statsFile, result)) {
+      llvm::errs() << "Could not read " << statsFile << "\n";
+      return std::nullopt;
+    }
+  }
+
+  llvm::StringRef runArgs[] = {exe};
+  result.runWall = -1;
+  for (unsigned i = 0; i < repeat; ++i) {
+    std::optional<double> wall = timeProcess(runArgs, true);
+    if (!wall)
+      return std::nullopt;
+    if (result.runWall < 0 || *wall < result.runWall)
+      result.runWall = *wall;
+  }
+  return result;
+}
+
+void writeResults(llvm::raw_ostream &os, llvm::ArrayRef<Result> results) {
+  llvm::json::OStream json(os, 2);
+  json.object([&] {
+    json.attribute("montyc", montyc.getValue());
+    json.attributeArray("results", [&] {
+      for (const Result &result : results)
+        json.object([&] {
+          json.attribute("program", result.program);
+          json.attribute("opt_level", result.level);
+          json.attribute("compile_wall", result.compileWall);
+          json.attributeObject("phases", [&] {
+            for (const auto &phase : result.phases)
+              json.attribute(phase.getKey(), phase.getValue());
+          });
+          json.attribute("vectorized_loops", result.vectorizedLoops);
+          json.attribute("run_wall", result.runWall);
+        });
+    });
+  });
+  os << "\n";
+}
+
+std::string getKey(llvm::StringRef program, llvm::StringRef level) {
+  return (program + "-O" + level).str();
+}
+
+// Prints every measurement that got slower than the baseline allows or
+// vectorized fewer loops and returns the number of regressions
+unsigned compareToBaseline(llvm::ArrayRef<Result> results) {
+  auto buffer = llvm::MemoryBuffer::getFile(baseline);
+  if (!buffer) {
+    llvm::errs() << "Could not open baseline " << baseline << "\n";
+    return 1;
+  }
+  auto json = llvm::json::parse((*buffer)->getBuffer());
+  if (!json) {
+    llvm::errs() << "Invalid baseline " << baseline << ": "
+                 << llvm::toString(json.takeError()) << "\n";
+    return 1;
+  }
+
+  llvm::StringMap<const llvm::json::Object *> entries;
+  const llvm::json::Object *root = json->getAsObject();
+  const llvm::json::Array *list = root ? root->getArray("results") : nullptr;
+  if (list)
+    for (const llvm::json::Value &value : *list)
+      if (const llvm::json::Object *entry = value.getAsObject())
+        entries[getKey(entry->getString("program").value_or(""),
+                       entry->getString("opt_level").value_or(""))] = entry;
+
+  unsigned regressions = 0;
+  auto check = [&](const Result &result, llvm::StringRef what, double current,
+                   std::optional<double> previous) {
+    if (!previous || current <= *previous * (1 + tolerance) ||
+        current - *previous < minTime)
+      return;
+    llvm::errs() << getKey(result.program, result.level) << ": " << what
+                 << " regressed from " << llvm::format("%.3fs", *previous)
+                 << " to " << llvm::format("%.3fs", current) << "\n";
+    ++regressions;
+  };
+
+  for (const Result &result : results) {
+    auto it = entries.find(getKey(result.program, result.level));
+    if (it == entries.end())
+      continue;
+    check(result, "compile time", result.compileWall,
+          it->second->getNumber("compile_wall"));
+    check(result, "run time", result.runWall,
+          it->second->getNumber("run_wall"));
+
+    int64_t vectorized =
+        it->second->getInteger("vectorized_loops").value_or(0);
+    if (result.vectorizedLoops < vectorized) {
+      llvm::errs() << getKey(result.program, result.level)
+                   << ": vectorized loops dropped from " << vectorized
+                   << " to " << result.vectorizedLoops << "\n";
+      ++regressions;
+    }
+  }
+  return regressions;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Monty benchmark suite\n");
+  if (levels.empty())
+    for (const char *level : {"0", "1", "2", "3"})
+      levels.push_back(level);
+  if (repeat == 0)
+    repeat = 1;
+
+  llvm::SmallString<128> dir(workDir);
+  if (dir.empty()) {
+    if (std::error_code EC =
+            llvm::sys::fs::createUniqueDirectory("monty-bench", dir)) {
+      llvm::errs() << "Could not create a work directory: " << EC.message()
+                   << "\n";
+      return 1;
+    }
+  } else if (std::error_code EC = llvm::sys::fs::create_directories(dir)) {
+    llvm::errs() << "Could not create " << dir << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  std::vector<Result> results;
+  bool failed = false;
+  for (const std::string &program : programs)
+    for (const std::string &level : levels) {
+      std::optional<Result> result = measure(program, level, dir);
+      if (!result) {
+        failed = true;
+        continue;
+      }
+      llvm::errs() << llvm::format(
+          "%-24s compile %8.3fs   run %8.3fs   vectorized %3lld loops\n",
+          getKey(result->program, level).c_str(), result->compileWall,
+          result->runWall, (long long)result->vectorizedLoops);
+      results.push_back(std::move(*result));
+    }
+
+  std::error_code EC;
+  llvm::raw_fd_ostream os(output, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    llvm::errs() << "Could not open file " << output << ": " << EC.message()
+                 << "\n";
+    return 1;
+  }
+  writeResults(os, results);
+
+  if (workDir.empty())
+    llvm::sys::fs::remove_directories(dir);
+
+  if (!baseline.empty() && compareToBaseline(results) != 0)
+    failed = true;
+  return failed ? 1 : 0;
+}
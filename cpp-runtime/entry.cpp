@@ -1,28 +1,21 @@
-#include <cstdio>
 extern "C" {
 double entry();
-}
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
+// Provided by the compiler-rt profile runtime, which is only linked into
+// programs built with --profile-generate
+#if defined(__GNUC__)
+__attribute__((weak)) int __llvm_profile_dump(void);
 #endif
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
-}
-
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
 }
 
 int main() {
 
   entry();
+
+#if defined(__GNUC__)
+  // Write the profile now, the handler it registers at exit then skips it
+  if (__llvm_profile_dump)
+    __llvm_profile_dump();
+#endif
   return 0;
 }
@@ -0,0 +1,13 @@
+#pragma once
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+// Builtins available to Monty programs through `using`
+extern "C" {
+DLLEXPORT double putchard(double X);
+DLLEXPORT double printd(double X);
+}
@@ -1,149 +1,282 @@
 #pragma once
 
-#include <llvm/IR/Value.h>
+#include "interner.hpp"
+#include <cassert>
+#include <cstdint>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace monty {
 namespace ast {
 
-// Forward declartion
-class NumberExprAST;
-class VariableExprAST;
-class BinaryExprAST;
-class UnaryExprAST;
-class IfExprAST;
-class LetExprAST;
-class FunctionCallExprAST;
-class FunctionPrototypeAST;
-class FunctionAST;
-
-class ASTVisitor {
-public:
-  virtual ~ASTVisitor() = default;
-
-  virtual void visit(const NumberExprAST &node) = 0;
-  virtual void visit(const VariableExprAST &node) = 0;
-  virtual void visit(const BinaryExprAST &node) = 0;
-  virtual void visit(const UnaryExprAST &node) = 0;
-  virtual void visit(const IfExprAST &node) = 0;
-  virtual void visit(const LetExprAST &node) = 0;
-  virtual void visit(const FunctionCallExprAST &node) = 0;
-  virtual void visit(const FunctionPrototypeAST &node) = 0;
-  virtual void visit(FunctionAST &node) = 0;
+// Expressions are stored data-oriented: every node kind lives in its own array
+// inside an ExprPool and nodes refer to each other through 32-bit ExprRefs.
+enum class ExprKind : uint8_t {
+  Number,
+  Variable,
+  Unary,
+  Binary,
+  If,
+  Let,
+  Call,
+  Vector,
+  Index,
+  For,
 };
 
-class ExprAST {
-public:
-  virtual ~ExprAST() = default;
-  virtual void accept(ASTVisitor &visitor) const noexcept = 0;
-};
+// Reference to an expression, the kind is packed into the top bits and the
+// index into the kind's array into the rest. A default constructed ExprRef is
+// invalid and is used to signal parse errors.
+class ExprRef {
+  static constexpr unsigned kindBits = 4;
+  static constexpr uint32_t indexMask = (1u << (32 - kindBits)) - 1;
 
-class NumberExprAST : public ExprAST {
-  double val;
+  uint32_t raw = ~0u;
 
 public:
-  NumberExprAST(double _val) noexcept : val(_val) {}
-  void accept(ASTVisitor &visitor) const noexcept override;
-  double getVal() const noexcept { return this->val; }
+  static constexpr uint32_t maxIndex = indexMask - 1;
+
+  ExprRef() noexcept = default;
+  ExprRef(ExprKind kind, uint32_t index) noexcept
+      : raw((static_cast<uint32_t>(kind) << (32 - kindBits)) | index) {
+    assert(index <= maxIndex && "expression pool overflow");
+  }
+
+  explicit operator bool() const noexcept { return this->raw != ~0u; }
+  ExprKind getKind() const noexcept {
+    return static_cast<ExprKind>(this->raw >> (32 - kindBits));
+  }
+  uint32_t getIndex() const noexcept { return this->raw & indexMask; }
+  // Kind and index packed into one value, unique within a pool
+  uint32_t getOpaqueValue() const noexcept { return this->raw; }
 };
 
-class VariableExprAST : public ExprAST {
-  std::string name;
+struct NumberExprAST {
+  double val;
+};
 
-public:
-  VariableExprAST(const std::string &_name) noexcept : name(_name) {}
+struct VariableExprAST {
+  Symbol name;
+};
 
-  void accept(ASTVisitor &visitor) const noexcept override;
-  std::string getName() const noexcept { return this->name; }
+// Operators are referenced by the Symbol of their spelling, e.g. `<=`
+struct UnaryExprAST {
+  Symbol opcode;
+  ExprRef operand;
 };
 
-class LetExprAST : public ExprAST {
-public:
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames;
-  std::unique_ptr<ExprAST> body;
-  LetExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> _varNames,
-      std::unique_ptr<ExprAST> _body)
-      : varNames(std::move(_varNames)), body(std::move(_body)) {}
+struct BinaryExprAST {
+  Symbol op;
+  ExprRef Lhs, Rhs;
+};
 
-  void accept(ASTVisitor &visitor) const noexcept override;
+struct IfExprAST {
+  ExprRef cond, then, otherwise;
 };
 
-class BinaryExprAST : public ExprAST {
-private:
-  char op;
+// The initializer may be invalid, the variable then starts out as 0.0
+struct LetBinding {
+  Symbol name;
+  ExprRef init;
+};
 
-public:
-  std::unique_ptr<ExprAST> Lhs, Rhs;
-  BinaryExprAST(char _op, std::unique_ptr<ExprAST> _Lhs,
-                std::unique_ptr<ExprAST> _Rhs) noexcept
-      : op(_op), Lhs(std::move(_Lhs)), Rhs(std::move(_Rhs)) {}
+// Bindings are the range [firstBinding, firstBinding + numBindings) of the
+// pool's binding array
+struct LetExprAST {
+  uint32_t firstBinding, numBindings;
+  ExprRef body;
+};
 
-  char getOp() const noexcept { return this->op; }
-  void accept(ASTVisitor &visitor) const noexcept override;
+// Arguments are the range [firstArg, firstArg + numArgs) of the pool's
+// argument array
+struct FunctionCallExprAST {
+  Symbol caller;
+  uint32_t firstArg, numArgs;
 };
 
-class UnaryExprAST : public ExprAST {
-private:
-  char opcode;
+// Vector literal `[a, b, ...]`, its elements are stored like call arguments
+struct VectorExprAST {
+  uint32_t firstElement, numElements;
+};
 
-public:
-  std::unique_ptr<ExprAST> operand;
+// Lane access `v[lane]`
+struct IndexExprAST {
+  ExprRef vector;
+  uint32_t lane;
+};
 
-  UnaryExprAST(char _opcode, std::unique_ptr<ExprAST> _operand)
-      : opcode(_opcode), operand(std::move(_operand)) {}
+// Counted loop `for i = start, end, step with acc = init in body`. The body
+// runs for i = start, start + step, ... while i is before `end`, the number
+// of iterations is computed once up front. The step is optional and defaults
+// to 1. With an accumulator the body's value becomes the accumulator's next
+// value and the loop yields its last one, otherwise the loop yields 0.0.
+struct ForExprAST {
+  Symbol var;
+  ExprRef start, end, step;
+  Symbol accumulator;
+  ExprRef init; // invalid if there is no accumulator
+  ExprRef body;
+};
 
-  char getOpcode() const noexcept { return this->opcode; }
+// Type of a value: a double, or a vector of `lanes` doubles written `vec<N>`
+struct Type {
+  uint32_t lanes = 0;
 
-  void accept(ASTVisitor &visitor) const noexcept override;
+  bool isVector() const noexcept { return this->lanes != 0; }
+  bool operator==(Type other) const noexcept {
+    return this->lanes == other.lanes;
+  }
+  bool operator!=(Type other) const noexcept { return !(*this == other); }
 };
 
-class IfExprAST : public ExprAST {
+// Owns the expressions of one top-level item. clear() drops all nodes but keeps
+// the array capacity, so parsing the next item does not allocate in the common
+// case.
+class ExprPool {
 public:
-  std::unique_ptr<ExprAST> cond, then, otherwise;
-
-  IfExprAST(std::unique_ptr<ExprAST> _cond, std::unique_ptr<ExprAST> _then,
-            std::unique_ptr<ExprAST> _otherwise) noexcept
-      : cond(std::move(_cond)), then(std::move(_then)),
-        otherwise(std::move(_otherwise)) {}
+  ExprRef addNumber(double val);
+  ExprRef addVariable(Symbol name);
+  ExprRef addUnary(Symbol opcode, ExprRef operand);
+  ExprRef addBinary(Symbol op, ExprRef Lhs, ExprRef Rhs);
+  ExprRef addIf(ExprRef cond, ExprRef then, ExprRef otherwise);
+  ExprRef addLet(llvm::ArrayRef<LetBinding> bindings, ExprRef body);
+  ExprRef addCall(Symbol caller, llvm::ArrayRef<ExprRef> args);
+  ExprRef addVector(llvm::ArrayRef<ExprRef> elements);
+  ExprRef addIndex(ExprRef vector, uint32_t lane);
+  ExprRef addFor(const ForExprAST &node);
+
+  const NumberExprAST &getNumber(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Number);
+    return this->numbers[ref.getIndex()];
+  }
+  const VariableExprAST &getVariable(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Variable);
+    return this->variables[ref.getIndex()];
+  }
+  const UnaryExprAST &getUnary(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Unary);
+    return this->unaries[ref.getIndex()];
+  }
+  const BinaryExprAST &getBinary(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Binary);
+    return this->binaries[ref.getIndex()];
+  }
+  const IfExprAST &getIf(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::If);
+    return this->ifs[ref.getIndex()];
+  }
+  const LetExprAST &getLet(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Let);
+    return this->lets[ref.getIndex()];
+  }
+  const FunctionCallExprAST &getCall(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Call);
+    return this->calls[ref.getIndex()];
+  }
+  const VectorExprAST &getVector(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Vector);
+    return this->vectors[ref.getIndex()];
+  }
+  const IndexExprAST &getIndex(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::Index);
+    return this->indices[ref.getIndex()];
+  }
+  const ForExprAST &getFor(ExprRef ref) const noexcept {
+    assert(ref.getKind() == ExprKind::For);
+    return this->fors[ref.getIndex()];
+  }
 
-  void accept(ASTVisitor &visitor) const noexcept override;
-};
+  llvm::ArrayRef<LetBinding>
+  getBindings(const LetExprAST &node) const noexcept {
+    return llvm::ArrayRef<LetBinding>(this->bindings)
+        .slice(node.firstBinding, node.numBindings);
+  }
+  llvm::ArrayRef<ExprRef>
+  getArgs(const FunctionCallExprAST &node) const noexcept {
+    return llvm::ArrayRef<ExprRef>(this->args).slice(node.firstArg,
+                                                     node.numArgs);
+  }
+  llvm::ArrayRef<ExprRef>
+  getElements(const VectorExprAST &node) const noexcept {
+    return llvm::ArrayRef<ExprRef>(this->args).slice(node.firstElement,
+                                                     node.numElements);
+  }
 
-class FunctionCallExprAST : public ExprAST {
-private:
-  std::string caller;
+  // Number of expression nodes in the pool
+  size_t size() const noexcept {
+    return this->numbers.size() + this->variables.size() +
+           this->unaries.size() + this->binaries.size() + this->ifs.size() +
+           this->lets.size() + this->calls.size() + this->vectors.size() +
+           this->indices.size() + this->fors.size();
+  }
 
-public:
-  std::vector<std::unique_ptr<ExprAST>> args;
+  void clear() noexcept;
 
-  FunctionCallExprAST(const std::string &_caller,
-                      std::vector<std::unique_ptr<ExprAST>> _args) noexcept
-      : caller(_caller), args(std::move(_args)) {}
+private:
+  std::vector<NumberExprAST> numbers;
+  std::vector<VariableExprAST> variables;
+  std::vector<UnaryExprAST> unaries;
+  std::vector<BinaryExprAST> binaries;
+  std::vector<IfExprAST> ifs;
+  std::vector<LetExprAST> lets;
+  std::vector<FunctionCallExprAST> calls;
+  std::vector<VectorExprAST> vectors;
+  std::vector<IndexExprAST> indices;
+  std::vector<ForExprAST> fors;
+  std::vector<LetBinding> bindings;
+  std::vector<ExprRef> args;
+};
 
-  std::string getCaller() const noexcept { return this->caller; }
-  void accept(ASTVisitor &visitor) const noexcept override;
+// Floating point semantics of a function, selected by an annotation
+enum class FPMode : uint8_t {
+  Default, // as selected on the command line
+  Fast,    // `fast`: every fast-math flag and contraction
+  Strict,  // `strict`: IEEE semantics, whatever the command line selects
 };
 
 // Represents a functions declaration
 class FunctionPrototypeAST {
 private:
-  std::string name;
-  std::vector<std::string> args;
+  Symbol name;
+  std::vector<Symbol> args;
+  // Types of the arguments, empty if all of them are doubles
+  std::vector<Type> argTypes;
+  Type returnType;
   unsigned precedence;
   bool isOperator;
+  // Annotated with `tailrec`: all recursion must be turned into a loop
+  bool tailRecursive = false;
+  FPMode fpMode = FPMode::Default;
 
 public:
-  FunctionPrototypeAST(const std::string &_name, std::vector<std::string> _args,
+  FunctionPrototypeAST(Symbol _name, std::vector<Symbol> _args,
                        bool _isOperator = false,
                        unsigned _precedence = 0) noexcept
-      : name(_name), args(std::move(_args)), isOperator(_isOperator),
-        precedence(_precedence) {};
+      : name(_name), args(std::move(_args)), precedence(_precedence),
+        isOperator(_isOperator) {};
 
-  std::string getName() const noexcept { return name; }
-  std::vector<std::string> getArgs() const noexcept { return args; }
+  Symbol getName() const noexcept { return name; }
+  llvm::ArrayRef<Symbol> getArgs() const noexcept { return args; }
+
+  Type getArgType(size_t index) const noexcept {
+    return index < this->argTypes.size() ? this->argTypes[index] : Type();
+  }
+  Type getReturnType() const noexcept { return this->returnType; }
+  void setTypes(std::vector<Type> _argTypes, Type _returnType) noexcept {
+    this->argTypes = std::move(_argTypes);
+    this->returnType = _returnType;
+  }
+  // Whether any argument or the result is a vector
+  bool usesVectors() const noexcept {
+    for (Type type : this->argTypes)
+      if (type.isVector())
+        return true;
+    return this->returnType.isVector();
+  }
 
   bool isUnaryOp() const noexcept {
     return this->isOperator && this->args.size() == 1;
@@ -152,26 +285,24 @@ public:
     return this->isOperator && this->args.size() == 2;
   }
 
-  char getOperatorName() const {
-    assert(isUnaryOp() || isBinaryOp());
-    return this->name[this->name.size() - 1];
-  }
-
   unsigned getBinaryPrecedence() const { return this->precedence; }
 
-  void accept(ASTVisitor &visitor) const noexcept;
+  bool isTailRecursive() const noexcept { return this->tailRecursive; }
+  void setTailRecursive(bool value) noexcept { this->tailRecursive = value; }
+
+  FPMode getFPMode() const noexcept { return this->fpMode; }
+  void setFPMode(FPMode mode) noexcept { this->fpMode = mode; }
 };
 
+// The prototype outlives the item, the body lives in the parser's ExprPool
 class FunctionAST {
 public:
   std::unique_ptr<FunctionPrototypeAST> prototype;
-  std::unique_ptr<ExprAST> body;
+  ExprRef body;
 
   FunctionAST(std::unique_ptr<FunctionPrototypeAST> _prototype,
-              std::unique_ptr<ExprAST> _body) noexcept
-      : prototype(std::move(_prototype)), body(std::move(_body)) {}
-
-  void accept(ASTVisitor &visitor) noexcept;
+              ExprRef _body) noexcept
+      : prototype(std::move(_prototype)), body(_body) {}
 };
 } // namespace ast
 } // namespace monty
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "generator.hpp"
+#include <atomic>
+#include <cstdint>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Function.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <string>
+
+namespace monty {
+namespace gen {
+
+// On-disk, content-addressed store of compiled functions. Each entry is the
+// native object file of a single function, named after the hash of its IR and
+// the settings it was compiled with. Safe to use from several threads and
+// several montyc processes at once.
+class CompilationCache {
+public:
+  CompilationCache(const std::string &_directory,
+                   uint64_t _maxSizeBytes) noexcept
+      : directory(_directory), maxSizeBytes(_maxSizeBytes) {}
+
+  // Returns the cached object file for `key`, or null on a miss
+  std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef key) noexcept;
+  void store(llvm::StringRef key, llvm::ArrayRef<char> object) noexcept;
+
+  // Evict entries unused for a week and the least recently used ones until the
+  // cache fits its size limit
+  void prune() const noexcept;
+
+  unsigned getHits() const noexcept { return this->hits; }
+  unsigned getMisses() const noexcept { return this->misses; }
+  void printStatistics(llvm::raw_ostream &os) const noexcept;
+
+private:
+  std::string directory;
+  uint64_t maxSizeBytes;
+  std::atomic<unsigned> hits{0};
+  std::atomic<unsigned> misses{0};
+
+  std::string getEntryPath(llvm::StringRef key) const noexcept;
+};
+
+// Cache key of a module holding a single function definition. The key covers
+// the function's IR, the prototypes of everything it calls and the target and
+// optimization settings it is compiled with.
+std::string hashFunctionModule(const llvm::Module &module,
+                               const CodeGenOptions &options) noexcept;
+
+} // namespace gen
+} // namespace monty
@@ -1,14 +1,40 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace monty {
 namespace drv {
 class Cli {
 public:
-  std::string source_file;
-  std::string output_file = "a.out"; // Default output
+  std::vector<std::string> source_files;
+  std::string output_file; // Defaults to a.out, or output.o with -c
+  std::string runtime_library;       // --runtime, prebuilt Monty runtime
   bool compile_only = false;         // -c flag
+  std::string emit = "obj";          // --emit, obj, llvm-bc or thin-bc
+  bool run_jit = false;              // --run, execute entry() in the JIT
+  unsigned opt_level = 0;            // -O0 .. -O3
+  unsigned size_level = 0;           // -Os = 1, -Oz = 2
+  std::string cpu = "generic";       // --cpu / -march, "native" for the host
+  std::string target_features;       // --target-features, e.g. "+avx2,+fma"
+  unsigned jobs = 1;                 // -j, compilation threads
+  std::string cache_dir;             // --cache-dir, per-function object cache
+  unsigned cache_max_size = 1024;    // --cache-max-size, in MiB
+  bool cache_stats = false;          // --cache-stats
+  bool time_report = false;          // --time-report
+  std::string stats_json;            // --stats-json, report file
+  bool print_ir = false;             // --print-ir
+  bool export_operators = false;     // --export-operators
+  bool whole_program = false;        // --whole-program
+  bool profile_generate = false;     // --profile-generate[=<file>]
+  std::string profile_file;          // raw profile written by the program
+  std::string profile_use;           // --profile-use=<file>, .profdata
+  std::vector<std::string> exports;  // --export, kept in whole-program mode
+  bool fast_math = false;            // -ffast-math
+  std::string fp_contract;           // --fp-contract, off, on or fast
+  std::vector<std::string> fp_flags; // --fp-flags, e.g. nnan,ninf
+  // --const-eval-steps, 0 disables compile-time evaluation of calls
+  unsigned const_eval_steps = 1000000;
   bool help_requested = false;
 
   Cli(int argc, char *argv[]);
@@ -17,6 +43,9 @@ public:
 
 private:
   void parse(int argc, char *argv[]);
+  void parseOptLevel(const std::string &arg);
+  void parseFPFlags(const std::string &list);
+  unsigned parseUnsigned(const std::string &value, const char *what);
 };
 } // namespace drv
 } // namespace monty
@@ -27,6 +27,7 @@ public:
   const std::vector<Error> &getErrors() const { return errors; }
   bool hasErrors() const { return !errors.empty(); }
   void printErors() const;
+  void printErors(const std::string &sourceFile) const;
 
 private:
   std::vector<Error> errors;
@@ -1,19 +1,63 @@
 #pragma once
 
+#include "emitter.hpp"
 #include "generator.hpp"
 #include "parser.hpp"
+#include "stats.hpp"
+#include <llvm/ADT/ArrayRef.h>
+#include <memory>
+#include <string>
 
 namespace monty {
 namespace drv {
 
-void process(gen::CodeGenerator &generator, syn::Parser &parser) noexcept;
-void linkToRuntime(const std::string &output);
-void cleanUp(const std::string &objectFile);
+// Parser and generator state of a single source file, isolated from all other
+// source files so that files can be compiled concurrently.
+struct CompilationUnit {
+  std::string sourceFile;
+  // Identifiers of this unit. Units are compiled concurrently, so every unit
+  // interns into its own table.
+  ast::Interner symbols;
+  std::unique_ptr<gen::CodeGenerator> generator;
+};
 
-void handleExtern(gen::CodeGenerator &generator, syn::Parser &parser) noexcept;
-void handleDefinition(gen::CodeGenerator &generator,
-                      syn::Parser &parser) noexcept;
+// Front end settings that do not change the generated code
+struct FrontendOptions {
+  bool printIR = false; // dump the IR of every function to stderr
+  stats::Statistics *stats = nullptr;
+};
+
+// Parse and generate code for `sourceFile`. Prints the diagnostics and returns
+// null if the file could not be compiled.
+std::unique_ptr<CompilationUnit>
+compileSource(const std::string &sourceFile,
+              const gen::CodeGenOptions &options,
+              const FrontendOptions &frontend = {}) noexcept;
+
+void process(gen::CodeGenerator &generator, syn::Parser &parser,
+             const FrontendOptions &frontend) noexcept;
+// Link the modules of all `units` into the module of the first one, so that
+// calls between source files can be optimized. The other units are left
+// without a module. Prints the errors and returns false on failure.
+bool linkUnits(llvm::ArrayRef<std::unique_ptr<CompilationUnit>> units) noexcept;
+// Link in-memory object files with the Monty runtime library into an
+// executable, in-process with lld. `profile` adds the compiler-rt profile
+// runtime for instrumented objects. Throws std::runtime_error on failure.
+void linkToRuntime(llvm::ArrayRef<gen::ObjectBuffer> objects,
+                   const std::string &runtime, const std::string &output,
+                   bool profile = false);
+// Combine in-memory object files into a single relocatable object file
+void linkRelocatable(llvm::ArrayRef<gen::ObjectBuffer> objects,
+                     const std::string &output);
+// Locate the runtime library installed alongside the montyc executable
+std::string defaultRuntimeLibrary(const char *argv0);
+
+void handleExtern(gen::CodeGenerator &generator, syn::Parser &parser,
+                  const FrontendOptions &frontend) noexcept;
+void handleDefinition(gen::CodeGenerator &generator, syn::Parser &parser,
+                      const FrontendOptions &frontend) noexcept;
 void handleTopLevelExpression(gen::CodeGenerator &generator,
-                              syn::Parser &parser) noexcept;
+                              syn::Parser &parser,
+                              const FrontendOptions &frontend) noexcept;
 } // namespace drv
 } // namespace monty
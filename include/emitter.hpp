@@ -0,0 +1,58 @@
+#pragma once
+
+#include "cache.hpp"
+#include "generator.hpp"
+#include "stats.hpp"
+#include <llvm/ADT/SmallVector.h>
+#include <vector>
+
+namespace monty {
+namespace gen {
+
+// A native object file held in memory
+using ObjectBuffer = llvm::SmallVector<char, 0>;
+
+// Emit `module` as a native object file into `buffer`. The time spent on each
+// function is added to `stats` if it is set.
+bool emitObject(llvm::Module &module, llvm::TargetMachine &targetMachine,
+                ObjectBuffer &buffer,
+                stats::Statistics *stats = nullptr) noexcept;
+
+// Optimize `module` and emit it as one or more object files.
+//
+// Large modules are split into partitions that are optimized and emitted on up
+// to `threads` worker threads, each in an LLVMContext of its own. The number
+// of partitions only depends on the module, never on `threads`, so the same
+// objects are produced for every thread count. In whole-program mode the
+// module is optimized as a whole before it is split. The module is consumed.
+// Optimization and code generation times are added to `stats` if it is set.
+// Returns an empty vector on failure.
+std::vector<ObjectBuffer>
+emitObjects(llvm::Module &module, const CodeGenOptions &options,
+            unsigned threads, stats::Statistics *stats = nullptr) noexcept;
+
+// Bitcode for link-time optimization together with modules from clang
+enum class BitcodeKind {
+  Full, // -flto
+  Thin, // -flto=thin, with a ThinLTO summary
+};
+
+// Run the LTO pre-link pipeline over `module` and write it to `os` as
+// bitcode, so that the linker can optimize it along with the code of a C++
+// host. Returns false on failure.
+bool emitBitcode(llvm::Module &module, const CodeGenOptions &options,
+                 BitcodeKind kind, llvm::raw_ostream &os,
+                 stats::Statistics *stats = nullptr) noexcept;
+
+// Emit `module` with one object file per function definition, taking the
+// objects of unchanged functions from `cache` and compiling the remaining ones
+// on up to `threads` workers. Newly compiled functions are added to the cache.
+// Functions are optimized in isolation, only operators are inlined into them.
+// Returns an empty vector on failure.
+std::vector<ObjectBuffer>
+emitCachedObjects(llvm::Module &module, const CodeGenOptions &options,
+                  CompilationCache &cache, unsigned threads,
+                  stats::Statistics *stats = nullptr) noexcept;
+
+} // namespace gen
+} // namespace monty
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "ast.hpp"
+#include <cstdint>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace monty {
+namespace eval {
+
+// Evaluates calls of side-effect-free functions with constant arguments at
+// compile time, so that e.g. `fib(30)` is emitted as a constant.
+//
+// A function is pure if it only calls pure functions and itself: nothing it
+// reaches calls a `using` extern. The bodies of pure functions are copied into
+// a pool owned by the evaluator, because every item's ExprPool is dropped once
+// the item has been generated.
+class ConstantEvaluator {
+public:
+  // Calls that do not finish within `stepBudget` evaluated expressions are
+  // left to run time. A budget of 0 disables the evaluator.
+  ConstantEvaluator(ast::Interner &_symbols, uint64_t _stepBudget) noexcept;
+
+  // Record the definition of `proto`, whose body is `body` in `pool`
+  void define(const ast::FunctionPrototypeAST &proto, const ast::ExprPool &pool,
+              ast::ExprRef body);
+
+  // Evaluate every call in `body` whose arguments are constant expressions.
+  // The results are looked up with getFolded() until the next fold(). Returns
+  // the number of calls that were folded.
+  unsigned fold(const ast::ExprPool &pool, ast::ExprRef body);
+
+  std::optional<double> getFolded(ast::ExprRef ref) const noexcept {
+    if (this->folded.empty())
+      return std::nullopt;
+    auto it = this->folded.find(ref.getOpaqueValue());
+    if (it == this->folded.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+private:
+  struct PureFunction {
+    std::vector<ast::Symbol> params;
+    ast::ExprRef body; // in `library`
+  };
+
+  ast::Interner &symbols;
+  uint64_t stepBudget;
+  // Built-in operators, the evaluator compares Symbols instead of spellings
+  ast::Symbol assignOp, addOp, subOp, mulOp, lessOp;
+
+  // Bodies of the pure functions. User-defined operators are stored as calls
+  // of their `binary`/`unary` functions.
+  ast::ExprPool library;
+  llvm::DenseMap<ast::Symbol, PureFunction> functions;
+
+  // Results of the last fold(), keyed by the opaque value of the ExprRef
+  llvm::DenseMap<uint32_t, double> folded;
+  unsigned foldedCalls = 0;
+
+  // Outcome of every call folded so far, keyed by the callee and the bits of
+  // its arguments, so that calls that exhaust the budget are only tried once.
+  // Cleared when a function is redefined.
+  std::map<std::pair<ast::Symbol, std::vector<uint64_t>>,
+           std::optional<double>>
+      calls;
+
+  // State of the call being evaluated. Variables of all active calls live on
+  // `frame`, the current call sees the entries from `frameBase` on.
+  std::vector<std::pair<ast::Symbol, double>> frame;
+  size_t frameBase = 0;
+  uint64_t stepsLeft = 0;
+  unsigned depth = 0; // nested evaluate() calls
+
+  ast::Symbol getOperatorFunction(const char *prefix, ast::Symbol op);
+  bool isBuiltin(ast::Symbol op) const noexcept;
+  double applyBuiltin(ast::Symbol op, double lhs, double rhs) const noexcept;
+
+  bool isPure(const ast::ExprPool &pool, ast::ExprRef ref, ast::Symbol self);
+  ast::ExprRef copy(const ast::ExprPool &pool, ast::ExprRef ref);
+
+  std::optional<double> foldExpr(const ast::ExprPool &pool, ast::ExprRef ref);
+  std::optional<double> foldCall(ast::ExprRef ref, ast::Symbol callee,
+                                 llvm::ArrayRef<double> args);
+
+  std::optional<double> call(ast::Symbol callee, llvm::ArrayRef<double> args);
+  std::optional<double> evaluate(ast::ExprRef ref);
+  std::optional<double> evaluateNode(ast::ExprRef ref);
+  double *lookup(ast::Symbol name) noexcept;
+};
+
+} // namespace eval
+} // namespace monty
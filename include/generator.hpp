@@ -1,82 +1,257 @@
 #pragma once
 
 #include "ast.hpp"
-#include <llvm/Analysis/CGSCCPassManager.h>
-#include <llvm/Analysis/LoopAnalysisManager.h>
+#include "evaluator.hpp"
+#include "stats.hpp"
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/PassInstrumentation.h>
-#include <llvm/IR/PassManager.h>
 #include <llvm/IR/Value.h>
 #include <llvm/MC/TargetRegistry.h>
-#include <llvm/Passes/StandardInstrumentations.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/PGOOptions.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/TargetParser/Host.h>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace monty {
 namespace gen {
 
-class CodeGenerator : public ast::ASTVisitor {
+// How a multiplication and an addition may be fused into one rounding step
+enum class FPContract {
+  Off,  // never
+  On,   // within one expression, like C's FP_CONTRACT
+  Fast, // wherever the optimizer finds them
+};
+
+// Code generation settings selected on the command line
+struct CodeGenOptions {
+  unsigned optLevel = 0;  // 0 .. 3
+  unsigned sizeLevel = 0; // 0 = none, 1 = Os, 2 = Oz
+  std::string cpu = "generic";
+  std::string features;
+  // Expressions a call may evaluate at compile time, 0 = never evaluate calls
+  uint64_t constEvalSteps = 1000000;
+  // Give operator functions external linkage so other objects can call them
+  bool exportOperators = false;
+  // Optimize the module as a whole program, see optimizeWholeProgram
+  bool wholeProgram = false;
+  // Functions besides `entry` that stay visible in whole-program mode
+  std::vector<std::string> exports;
+  // Instrument the code with profile counters, written to `profileFile` when
+  // the program exits. `%m` etc. are expanded by the profile runtime.
+  bool profileGenerate = false;
+  std::string profileFile = "default_%m.profraw";
+  // Indexed profile (.profdata) that guides the optimization
+  std::string profileUse;
+  // Fast-math flags of every floating point operation and contraction of
+  // products and sums, unless a function is annotated `fast` or `strict`.
+  // Contraction is only selected through `fpContract`.
+  llvm::FastMathFlags fastMath;
+  FPContract fpContract = FPContract::Off;
+
+  llvm::OptimizationLevel getOptimizationLevel() const noexcept;
+  llvm::CodeGenOptLevel getCodeGenOptLevel() const noexcept;
+  // Profile instrumentation or use for the pass pipeline, if any
+  std::optional<llvm::PGOOptions> getPGOOptions() const;
+};
+
+// Resolve a CPU of "native" to the host CPU name and its features
+void resolveHostTarget(CodeGenOptions &options) noexcept;
+
+// Create a target machine for `triple` configured from `options`. Returns null
+// if the target is not available. A CPU of "native" is not resolved here.
+std::unique_ptr<llvm::TargetMachine>
+createTargetMachine(const llvm::Triple &triple,
+                    const CodeGenOptions &options) noexcept;
+
+// Run the standard per-module optimization pipeline for `level` over `module`.
+// `targetMachine` may be null, in which case no target cost model is used.
+// The pipeline instruments the module or applies a profile according to `pgo`.
+// `callbacks`, if set, are called around every pass.
+void optimizeModule(
+    llvm::Module &module, llvm::TargetMachine *targetMachine,
+    llvm::OptimizationLevel level,
+    std::optional<llvm::PGOOptions> pgo = std::nullopt,
+    llvm::PassInstrumentationCallbacks *callbacks = nullptr) noexcept;
+
+// Optimize `module` as a complete program: every definition except `entry`,
+// the functions in `options.exports` and exported operators is made local, so
+// that the interprocedural passes may specialize, merge or delete it.
+void optimizeWholeProgram(
+    llvm::Module &module, llvm::TargetMachine *targetMachine,
+    const CodeGenOptions &options,
+    llvm::PassInstrumentationCallbacks *callbacks = nullptr) noexcept;
+
+// Inline the always-inline operator functions of `module` into their users.
+// Run on whole modules before they are split into parts that are optimized
+// separately, so that every part sees the operator bodies.
+void inlineOperators(llvm::Module &module) noexcept;
+
+class CodeGenerator {
 private:
-  llvm::Value *lastValue;
-  llvm::Function *lastFunctionValue;
-  // LLVM analysis managers
-  /*
-  std::unique_ptr<llvm::FunctionPassManager> fpm;
-  std::unique_ptr<llvm::LoopAnalysisManager> lam;
-  std::unique_ptr<llvm::FunctionAnalysisManager> fam;
-  std::unique_ptr<llvm::CGSCCAnalysisManager> cgam;
-  std::unique_ptr<llvm::ModuleAnalysisManager> mam;
-  std::unique_ptr<llvm::PassInstrumentationCallbacks> pic;
-  std::unique_ptr<llvm::StandardInstrumentations> si;
-  */
-
-  std::map<char, int> &binopPrecedence;
-
-  llvm::Function *getFunction(std::string name) noexcept;
+  ast::Interner &symbols;
+  CodeGenOptions options;
+  // Phase timings are recorded here if set
+  stats::Statistics *stats;
+  // Folds calls of pure functions with constant arguments
+  eval::ConstantEvaluator constants;
+
+  // Errors reported while generating code
+  unsigned errors = 0;
+
+  // Expressions of the function currently being emitted
+  const ast::ExprPool *exprPool = nullptr;
+
+  // Innermost binding of every variable, indexed by Symbol. Bindings that are
+  // shadowed by a `let` are saved on the scope stack and restored from it.
+  std::vector<llvm::AllocaInst *> namedValues;
+  std::vector<std::pair<ast::Symbol, llvm::AllocaInst *>> scopeStack;
+
+  // Functions declared in the module so far
+  llvm::DenseMap<ast::Symbol, llvm::Function *> functions;
+
+  // Recursion in the body of the function being emitted
+  struct RecursionInfo {
+    bool tailCalls = false; // calls to itself in tail position
+    // Operator of `x + f(...)` or `x * f(...)` in tail position, only looked
+    // for in `tailrec` functions as it reassociates floating point math
+    std::optional<ast::Symbol> accumulateOp;
+    // Why the recursion cannot be turned into a loop
+    const char *problem = nullptr;
+  };
+
+  // Calls in tail position of the function being emitted. Calls to itself
+  // store the new arguments in `params` and jump back to `recurseBB`; an
+  // accumulated operand is first combined into `accumulator`.
+  ast::Symbol currentName = 0;
+  bool currentIsOperator = false;
+  std::vector<llvm::AllocaInst *> params;
+  llvm::BasicBlock *recurseBB = nullptr;
+  llvm::AllocaInst *accumulator = nullptr;
+  std::optional<ast::Symbol> accumulateOp;
+
+  // Floating point semantics of a function body. The fast-math flags allow
+  // contraction iff it is Fast.
+  struct FPSemantics {
+    llvm::FastMathFlags flags;
+    FPContract contract = FPContract::Off;
+
+    // Equal for semantics that generate the same code
+    unsigned getKey() const noexcept;
+  };
+
+  // Semantics of the function being emitted, its flags are set on the builder
+  FPSemantics fpSemantics;
+
+  // Operators take the semantics of the function they are used in. Each
+  // definition is recorded with its own semantics, uses with other semantics
+  // call a copy of it, see getOperatorVariant.
+  llvm::DenseMap<llvm::Function *, FPSemantics> operatorSemantics;
+  std::map<std::pair<llvm::Function *, unsigned>, llvm::Function *>
+      operatorVariants;
+  llvm::DenseMap<llvm::Function *, llvm::Function *> variantOrigins;
+  // Instructions of operators that control counted loops, which get no
+  // fast-math flags in any copy
+  llvm::DenseMap<llvm::Function *, llvm::SmallVector<llvm::Instruction *, 0>>
+      loopControl;
+
+  llvm::Function *getFunction(ast::Symbol name) noexcept;
+  llvm::AllocaInst *lookupVariable(ast::Symbol name) const noexcept;
+  void bindVariable(ast::Symbol name, llvm::AllocaInst *alloca);
+  void popScope(size_t depth) noexcept;
   llvm::AllocaInst *createEntryBlockAlloca(llvm::Function *function,
-                                           llvm::StringRef varName);
+                                           llvm::StringRef varName,
+                                           llvm::Type *type);
+
+  // Lowering of Monty types, vectors become LLVM vectors of doubles
+  llvm::Type *getType(ast::Type type) const noexcept;
+  llvm::FunctionType *
+  getFunctionType(const ast::FunctionPrototypeAST &node) const noexcept;
+  // Broadcast a double operand to the width of a vector operand. Fails for
+  // vectors of different widths.
+  bool unifyOperands(llvm::Value *&lhs, llvm::Value *&rhs);
+  // Select the fast-math flags and contraction of `node`'s body
+  void setFPSemantics(const ast::FunctionPrototypeAST &node);
+  llvm::Value *contractProducts(llvm::Value *sum);
+  // The operator `F` as defined, or a copy of it, with `semantics`
+  llvm::Function *getOperatorVariant(llvm::Function *F,
+                                     const FPSemantics &semantics);
+  llvm::Value *emitOperatorCall(llvm::Function *F,
+                                llvm::MutableArrayRef<llvm::Value *> operands,
+                                const char *name);
+
+  bool isSelfCall(ast::ExprRef ref) const noexcept;
+  bool containsCall(ast::ExprRef ref) const noexcept;
+  void analyzeRecursion(ast::ExprRef ref, bool tail, bool accumulate,
+                        RecursionInfo &info) const noexcept;
+
+  // Expression lowering, dispatched on the kind stored in the ExprRef. An
+  // expression in tail position may end its block with a jump or a return, a
+  // placeholder value is returned then.
+  llvm::Value *emitExpr(ast::ExprRef ref, bool tail = false);
+  llvm::Value *emitNumber(const ast::NumberExprAST &node);
+  llvm::Value *emitVariable(const ast::VariableExprAST &node);
+  llvm::Value *emitBinary(const ast::BinaryExprAST &node, bool tail);
+  llvm::Value *emitUnary(const ast::UnaryExprAST &node);
+  llvm::Value *emitIf(const ast::IfExprAST &node, bool tail);
+  llvm::Value *emitLet(const ast::LetExprAST &node, bool tail);
+  llvm::Value *emitCall(const ast::FunctionCallExprAST &node, bool tail);
+  llvm::Value *emitReduction(llvm::StringRef name,
+                             const ast::FunctionCallExprAST &node);
+  llvm::Value *emitVector(const ast::VectorExprAST &node);
+  llvm::Value *emitIndex(const ast::IndexExprAST &node);
+  llvm::Value *emitFor(const ast::ForExprAST &node);
+  llvm::Value *emitTailCall(llvm::CallInst *call);
+  llvm::Value *emitAccumulation(const ast::BinaryExprAST &node);
+  llvm::Value *emitRecursion(llvm::ArrayRef<llvm::Value *> args,
+                             llvm::Value *accumulated);
+  llvm::Value *combine(llvm::Value *accumulated, llvm::Value *value);
 
 public:
   // LLVM builder utils
   std::unique_ptr<llvm::LLVMContext> llvmContext;
   std::unique_ptr<llvm::IRBuilder<>> llvmBuilder;
   std::unique_ptr<llvm::Module> llvmModule;
-  llvm::TargetMachine *targetMachine;
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
   llvm::Triple targetTriplet;
   // Symbol table
-  std::map<std::string, llvm::AllocaInst *> namedValues;
-  std::map<std::string, std::unique_ptr<ast::FunctionPrototypeAST>>
+  llvm::DenseMap<ast::Symbol, std::unique_ptr<ast::FunctionPrototypeAST>>
       functionPrototypes;
 
   // LLVM util for exiting on code generation error
   llvm::ExitOnError exitOnErr;
 
-  CodeGenerator(std::map<char, int> &_binopPrecedence) noexcept;
-
-  // TODO: Update error handling
-  llvm::Value *logError(const char *str) const noexcept;
-
-  llvm::Value *getLastValue() const noexcept { return this->lastValue; }
-  llvm::Function *getLastFunctionValue() const noexcept {
-    return this->lastFunctionValue;
-  }
-
-  // ASTVisitor interface
-  void visit(const ast::NumberExprAST &node) override;
-  void visit(const ast::VariableExprAST &node) override;
-  void visit(const ast::BinaryExprAST &node) override;
-  void visit(const ast::UnaryExprAST &node) override;
-  void visit(const ast::IfExprAST &node) override;
-  void visit(const ast::LetExprAST &node) override;
-  void visit(const ast::FunctionCallExprAST &node) override;
-  void visit(const ast::FunctionPrototypeAST &node) override;
-  void visit(ast::FunctionAST &node) override;
+  CodeGenerator(ast::Interner &_symbols, const CodeGenOptions &_options = {},
+                stats::Statistics *_stats = nullptr) noexcept;
+
+  // Whether the target machine could be created. Nothing may be generated
+  // otherwise.
+  bool valid() const noexcept { return this->targetMachine != nullptr; }
+
+  // Print an error and count it. Returns null for the failed expression.
+  llvm::Value *logError(const char *str) noexcept;
+  // Whether any definition failed to generate, e.g. a rejected `tailrec`
+  bool hasErrors() const noexcept { return this->errors != 0; }
+
+  const CodeGenOptions &getOptions() const noexcept { return this->options; }
+
+  // Declare the function described by `node` in the module
+  llvm::Function *emitPrototype(const ast::FunctionPrototypeAST &node);
+  // Emit the definition of `node`, whose body lives in `pool`. Takes ownership
+  // of the prototype. Returns null and reports an error on failure.
+  llvm::Function *emitFunction(ast::FunctionAST &node,
+                               const ast::ExprPool &pool);
 };
 } // namespace gen
 } // namespace monty
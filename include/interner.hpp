@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <vector>
+
+namespace monty {
+namespace ast {
+
+// Compact identifier for an interned name. Symbols are dense, starting at 0,
+// so they can index plain vectors.
+using Symbol = uint32_t;
+
+// Maps every distinct identifier of a compilation unit to a Symbol. Names are
+// hashed once when the parser sees them, afterwards they are compared and
+// looked up by Symbol only.
+class Interner {
+public:
+  Symbol intern(llvm::StringRef name) {
+    Symbol next = static_cast<Symbol>(this->names.size());
+    auto [entry, inserted] = this->symbols.try_emplace(name, next);
+    if (inserted)
+      this->names.push_back(entry->getKey());
+    return entry->second;
+  }
+
+  // The returned name is owned by the interner and stays valid with it
+  llvm::StringRef getName(Symbol symbol) const noexcept {
+    return this->names[symbol];
+  }
+
+  size_t size() const noexcept { return this->names.size(); }
+
+private:
+  llvm::StringMap<Symbol> symbols;
+  std::vector<llvm::StringRef> names;
+};
+} // namespace ast
+} // namespace monty
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "generator.hpp"
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <vector>
+
+namespace monty {
+namespace jit {
+
+// Hand the generated modules over to an ORC LLJIT instance that compiles each
+// function lazily on its first call, then run `entry()`. Code is generated and
+// optimized for `options.cpu` and `options.features`, and a profile in
+// `options.profileUse` is applied. Returns the process exit code, which is 0
+// once `entry()` returns, whatever its result, like for linked executables.
+int run(std::vector<llvm::orc::ThreadSafeModule> modules,
+        const gen::CodeGenOptions &options);
+
+} // namespace jit
+} // namespace monty
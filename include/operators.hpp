@@ -0,0 +1,56 @@
+#pragma once
+
+#include "interner.hpp"
+#include <array>
+#include <cstdint>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <string>
+#include <vector>
+
+namespace monty {
+namespace syn {
+
+enum class Associativity : uint8_t { Left, Right };
+
+struct OperatorInfo {
+  std::string spelling;
+  // Interned spelling, stored in the AST for the generator
+  ast::Symbol symbol;
+  // 0 if the operator can only be used as a unary operator
+  int precedence = 0;
+  Associativity associativity = Associativity::Left;
+};
+
+// Characters that make up operators. Parentheses, ',', ';', '#', '.', '_' and
+// brackets are structural and never part of an operator.
+bool isOperatorChar(char c) noexcept;
+
+// Every operator known to a parser, indexed by a dense operator id. Operators
+// are spelled with one or more operator characters, e.g. `+`, `<=` or `|>`.
+class OperatorTable {
+public:
+  // Registers the builtin operators `=`, `<`, `+`, `-` and `*`
+  explicit OperatorTable(ast::Interner &_symbols);
+
+  // Returns the id of `spelling`, adding it as a unary-only operator if it is
+  // not known yet
+  unsigned define(llvm::StringRef spelling);
+  void defineBinary(llvm::StringRef spelling, int precedence,
+                    Associativity associativity);
+
+  // Id of the longest known operator that is a prefix of `run`, or -1
+  int matchPrefix(llvm::StringRef run) const noexcept;
+
+  const OperatorInfo &get(unsigned id) const noexcept {
+    return this->operators[id];
+  }
+
+private:
+  ast::Interner &symbols;
+  std::vector<OperatorInfo> operators;
+  // Ids of the operators starting with a character, longest spelling first
+  std::array<llvm::SmallVector<unsigned, 2>, 128> byFirstChar;
+};
+} // namespace syn
+} // namespace monty
@@ -2,8 +2,8 @@
 
 #include "../include/ast.hpp"
 #include "../include/diagnostics.hpp"
-#include <istream>
-#include <map>
+#include "../include/operators.hpp"
+#include <llvm/ADT/StringRef.h>
 #include <memory>
 
 namespace monty {
@@ -27,24 +27,34 @@ enum Token {
 
   token_let = -13,
   token_in = -14,
+
+  // A run of operator characters, see isOperatorChar
+  token_operator = -15,
+
+  // Function annotations
+  token_tailrec = -16,
+
+  token_for = -17,
+  token_with = -18,
+
+  // Floating point annotations
+  token_fast = -19,
+  token_strict = -20,
 };
 
 class Parser {
 public:
-  // Source location tracking
-  int currentLine = 1;
-  int currentCol = 0;
-  int lastChar = ' ';
-
   // Diagnostics class for tracking compiler erros
   Diagnostics &diag;
 
-  // The location of the token currently stored in `curToken`
-  SourceLoc curLoc = {1, 0};
-  Parser(Diagnostics &_diag, std::map<char, int> &_binopPrecedence,
-         std::istream &_inputStream) noexcept
-      : diag(_diag), binopPrecedence(_binopPrecedence),
-        inputStream(_inputStream) {}
+  // Lex directly out of `_source`, usually a memory mapped file. Identifiers
+  // are slices of it, so it must outlive the parser and its expressions.
+  Parser(Diagnostics &_diag, ast::Interner &_symbols,
+         llvm::StringRef _source) noexcept
+      : diag(_diag), symbols(_symbols), operators(_symbols),
+        bufferPtr(_source.begin()), bufferEnd(_source.end()),
+        tokenStart(_source.begin()), locPtr(_source.begin()),
+        lineStart(_source.begin()) {}
 
   int getNextToken() noexcept;
   int getCurrentToken() const noexcept { return this->curToken; }
@@ -54,34 +64,64 @@ public:
   std::unique_ptr<ast::FunctionAST> parseDefinition() noexcept;
   std::unique_ptr<ast::FunctionPrototypeAST> parseExtern() noexcept;
 
+  // Expressions referenced by the FunctionASTs returned above
+  const ast::ExprPool &getExprPool() const noexcept { return this->exprPool; }
+
+  // Release the expressions of the previous top-level item. Bodies returned by
+  // parseDefinition() and parseTopLevelExpr() are invalidated.
+  void resetExprPool() noexcept { this->exprPool.clear(); }
+
 private:
   char curToken;
-  std::string identifierStr;
+  llvm::StringRef identifierStr;
   double numVal;
-  std::map<char, int> &binopPrecedence;
-  std::istream &inputStream;
+  ast::Interner &symbols;
+
+  // Operators defined so far. For a token_operator, `identifierStr` holds its
+  // spelling and `operatorId` its entry in the table, or -1 if it is unknown.
+  OperatorTable operators;
+  int operatorId = -1;
+  // Lex the next operator as the whole run of operator characters instead of
+  // the longest known operator, used for operator definitions
+  bool lexOperatorRun = false;
+
+  // Lexer position and the start of the token stored in `curToken`
+  const char *bufferPtr;
+  const char *bufferEnd;
+  const char *tokenStart;
+
+  // Line/column are only computed when a diagnostic needs them. Newlines
+  // between `locPtr` and the requested position are counted in one pass.
+  const char *locPtr;
+  const char *lineStart;
+  int locLine = 1;
+  ast::ExprPool exprPool;
 
   // TODO add better compiler error handling
-  std::unique_ptr<ast::ExprAST> logError(const char *Str) const noexcept;
+  ast::ExprRef logError(const char *Str) noexcept;
   std::unique_ptr<ast::FunctionPrototypeAST>
 
-  logErrorP(const char *Str) const noexcept;
+  logErrorP(const char *Str) noexcept;
   int getToken() noexcept;
-  int getNextChar() noexcept;
-
-  std::unique_ptr<ast::ExprAST> parseExpression() noexcept;
-  std::unique_ptr<ast::ExprAST> parseIdentifierExpr() noexcept;
-  std::unique_ptr<ast::ExprAST> parsePrimery() noexcept;
-  std::unique_ptr<ast::ExprAST> parseUnary() noexcept;
-  std::unique_ptr<ast::ExprAST>
-  parseBinOpRhs(int exprPrec, std::unique_ptr<ast::ExprAST> Lhs) noexcept;
-  std::unique_ptr<ast::ExprAST> parseIfExpr() noexcept;
-  std::unique_ptr<ast::ExprAST> parseLetExpr() noexcept;
-  std::unique_ptr<ast::ExprAST> parseNumberExpr() noexcept;
-  std::unique_ptr<ast::ExprAST> parseParenExpr() noexcept;
+  SourceLoc getLocation(const char *pos) noexcept;
+
+  ast::ExprRef parseExpression(int minPrecedence = 1) noexcept;
+  ast::ExprRef parseIdentifierExpr() noexcept;
+  ast::ExprRef parsePrimery() noexcept;
+  ast::ExprRef parseUnary() noexcept;
+  ast::ExprRef parsePostfix() noexcept;
+  ast::ExprRef parseVectorExpr() noexcept;
+  ast::ExprRef parseIfExpr() noexcept;
+  ast::ExprRef parseLetExpr() noexcept;
+  ast::ExprRef parseForExpr() noexcept;
+  ast::ExprRef parseNumberExpr() noexcept;
+  ast::ExprRef parseParenExpr() noexcept;
   std::unique_ptr<ast::FunctionPrototypeAST> parsePrototype() noexcept;
+  bool parseType(ast::Type &type) noexcept;
 
-  int getTokenPrecedence() const noexcept;
+  bool isOperator(llvm::StringRef spelling) const noexcept;
+  // The current token as a binary operator, null if it is none
+  const OperatorInfo *getBinaryOperator() const noexcept;
 };
 } // namespace syn
 } // namespace monty
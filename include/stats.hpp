@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace monty {
+namespace stats {
+
+// Compilation phases that are timed separately. Lexing happens on demand
+// while parsing and is part of the Parse phase. Fold is the evaluation of
+// calls with constant arguments before a function's IR is generated.
+enum class Phase : unsigned {
+  Parse,
+  Fold,
+  IRGen,
+  Verify,
+  Optimize,
+  CodeGen,
+  Link,
+};
+constexpr unsigned numPhases = 7;
+
+const char *getPhaseName(Phase phase) noexcept;
+
+// Wall clock time and CPU time of the calling thread, in seconds
+struct PhaseTime {
+  double wall = 0;
+  double cpu = 0;
+
+  static PhaseTime now() noexcept;
+
+  PhaseTime &operator+=(const PhaseTime &other) noexcept {
+    this->wall += other.wall;
+    this->cpu += other.cpu;
+    return *this;
+  }
+  PhaseTime operator-(const PhaseTime &other) const noexcept {
+    return {this->wall - other.wall, this->cpu - other.cpu};
+  }
+};
+
+// Times and counters of one montyc invocation. Shared by all compilation
+// threads, phase times of concurrent threads add up.
+class Statistics {
+public:
+  std::atomic<uint64_t> expressions{0};
+  std::atomic<uint64_t> functions{0};
+  std::atomic<uint64_t> externs{0};
+  std::atomic<uint64_t> foldedCalls{0}; // evaluated at compile time
+  std::atomic<uint64_t> vectorizedLoops{0}; // by the loop vectorizer
+
+  void addPhaseTime(Phase phase, const PhaseTime &time) noexcept;
+  // Adds to the time spent on the function `name` over all phases
+  void addFunctionTime(llvm::StringRef name, double wall);
+
+  // Human readable report listing the `topFunctions` slowest functions
+  void printReport(llvm::raw_ostream &os, unsigned topFunctions) const;
+  // The same data as a JSON object, returns false if `path` can't be written
+  bool writeJSON(llvm::StringRef path, unsigned topFunctions) const;
+
+private:
+  PhaseTime start = PhaseTime::now();
+
+  mutable std::mutex lock;
+  std::array<PhaseTime, numPhases> phases;
+  std::map<std::string, double> functionTimes;
+
+  std::vector<std::pair<std::string, double>>
+  getSlowestFunctions(unsigned count) const;
+};
+
+// Adds the time from construction until stop() or destruction to `phase`.
+// Does nothing if `stats` is null.
+class PhaseTimer {
+public:
+  PhaseTimer(Statistics *_stats, Phase _phase) noexcept
+      : stats(_stats), phase(_phase) {
+    if (this->stats)
+      this->start = PhaseTime::now();
+  }
+  ~PhaseTimer() { stop(); }
+
+  void stop() noexcept {
+    if (this->stats)
+      this->stats->addPhaseTime(this->phase, PhaseTime::now() - this->start);
+    this->stats = nullptr;
+  }
+
+private:
+  Statistics *stats;
+  Phase phase;
+  PhaseTime start;
+};
+
+// Peak resident set size of the process in bytes
+uint64_t getPeakRSS() noexcept;
+
+} // namespace stats
+} // namespace monty
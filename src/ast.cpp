@@ -1,44 +1,94 @@
 #include "../include/ast.hpp"
-#include <llvm/ADT/APFloat.h>
-#include <llvm/IR/Constants.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/Type.h>
-#include <llvm/IR/Verifier.h>
 
 namespace monty {
 namespace ast {
-void NumberExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+
+// Index of the element that is about to be appended to `nodes`
+template <typename T>
+static uint32_t nextIndex(const std::vector<T> &nodes) noexcept {
+  assert(nodes.size() <= ExprRef::maxIndex && "expression pool overflow");
+  return static_cast<uint32_t>(nodes.size());
+}
+
+ExprRef ExprPool::addNumber(double val) {
+  ExprRef ref(ExprKind::Number, nextIndex(this->numbers));
+  this->numbers.push_back({val});
+  return ref;
+}
+
+ExprRef ExprPool::addVariable(Symbol name) {
+  ExprRef ref(ExprKind::Variable, nextIndex(this->variables));
+  this->variables.push_back({name});
+  return ref;
+}
+
+ExprRef ExprPool::addUnary(Symbol opcode, ExprRef operand) {
+  ExprRef ref(ExprKind::Unary, nextIndex(this->unaries));
+  this->unaries.push_back({opcode, operand});
+  return ref;
 }
 
-void VariableExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addBinary(Symbol op, ExprRef Lhs, ExprRef Rhs) {
+  ExprRef ref(ExprKind::Binary, nextIndex(this->binaries));
+  this->binaries.push_back({op, Lhs, Rhs});
+  return ref;
 }
 
-void BinaryExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addIf(ExprRef cond, ExprRef then, ExprRef otherwise) {
+  ExprRef ref(ExprKind::If, nextIndex(this->ifs));
+  this->ifs.push_back({cond, then, otherwise});
+  return ref;
 }
 
-void UnaryExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addLet(llvm::ArrayRef<LetBinding> bindings, ExprRef body) {
+  ExprRef ref(ExprKind::Let, nextIndex(this->lets));
+  uint32_t first = static_cast<uint32_t>(this->bindings.size());
+  this->bindings.insert(this->bindings.end(), bindings.begin(), bindings.end());
+  this->lets.push_back({first, static_cast<uint32_t>(bindings.size()), body});
+  return ref;
 }
 
-void IfExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addCall(Symbol caller, llvm::ArrayRef<ExprRef> args) {
+  ExprRef ref(ExprKind::Call, nextIndex(this->calls));
+  uint32_t first = static_cast<uint32_t>(this->args.size());
+  this->args.insert(this->args.end(), args.begin(), args.end());
+  this->calls.push_back({caller, first, static_cast<uint32_t>(args.size())});
+  return ref;
 }
 
-void LetExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addVector(llvm::ArrayRef<ExprRef> elements) {
+  ExprRef ref(ExprKind::Vector, nextIndex(this->vectors));
+  uint32_t first = static_cast<uint32_t>(this->args.size());
+  this->args.insert(this->args.end(), elements.begin(), elements.end());
+  this->vectors.push_back({first, static_cast<uint32_t>(elements.size())});
+  return ref;
 }
 
-void FunctionCallExprAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addIndex(ExprRef vector, uint32_t lane) {
+  ExprRef ref(ExprKind::Index, nextIndex(this->indices));
+  this->indices.push_back({vector, lane});
+  return ref;
 }
 
-void FunctionPrototypeAST::accept(ASTVisitor &visitor) const noexcept {
-  visitor.visit(*this);
+ExprRef ExprPool::addFor(const ForExprAST &node) {
+  ExprRef ref(ExprKind::For, nextIndex(this->fors));
+  this->fors.push_back(node);
+  return ref;
 }
 
-void FunctionAST::accept(ASTVisitor &visitor) noexcept { visitor.visit(*this); }
+void ExprPool::clear() noexcept {
+  this->numbers.clear();
+  this->variables.clear();
+  this->unaries.clear();
+  this->binaries.clear();
+  this->ifs.clear();
+  this->lets.clear();
+  this->calls.clear();
+  this->vectors.clear();
+  this->indices.clear();
+  this->fors.clear();
+  this->bindings.clear();
+  this->args.clear();
+}
 } // namespace ast
 } // namespace monty
@@ -0,0 +1,109 @@
+#include "../include/cache.hpp"
+#include <chrono>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/CachePruning.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/SHA256.h>
+
+namespace monty {
+namespace gen {
+
+// Bump whenever the layout of cache entries or the key changes
+static constexpr const char *cacheVersion = "monty-cache-1";
+
+std::string CompilationCache::getEntryPath(llvm::StringRef key) const noexcept {
+  // The "llvmcache-" prefix marks files that llvm::pruneCache may evict
+  llvm::SmallString<128> path(this->directory);
+  llvm::sys::path::append(path, "llvmcache-" + key);
+  return std::string(path);
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+CompilationCache::lookup(llvm::StringRef key) noexcept {
+  std::string path = getEntryPath(key);
+
+  int fd;
+  if (llvm::sys::fs::openFileForRead(path, fd)) {
+    ++this->misses;
+    return nullptr;
+  }
+
+  auto buffer = llvm::MemoryBuffer::getOpenFile(
+      llvm::sys::fs::convertFDToNativeFile(fd), path, /*FileSize=*/-1);
+  // Refresh the entry's timestamps so that pruning evicts it last.
+  llvm::sys::fs::setLastAccessAndModificationTime(
+      fd, std::chrono::system_clock::now());
+  llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+
+  if (!buffer) {
+    ++this->misses;
+    return nullptr;
+  }
+
+  ++this->hits;
+  return std::move(*buffer);
+}
+
+void CompilationCache::store(llvm::StringRef key,
+                             llvm::ArrayRef<char> object) noexcept {
+  if (llvm::sys::fs::create_directories(this->directory))
+    return;
+
+  // Write to a unique temporary file and rename it into place, so concurrent
+  // readers never observe a partially written entry.
+  llvm::SmallString<128> tempPath(this->directory);
+  llvm::sys::path::append(tempPath, "tmp-%%%%%%%%.o");
+  int fd;
+  if (llvm::sys::fs::createUniqueFile(tempPath, fd, tempPath))
+    return;
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os.write(object.data(), object.size());
+  }
+
+  if (llvm::sys::fs::rename(tempPath, getEntryPath(key)))
+    llvm::sys::fs::remove(tempPath);
+}
+
+void CompilationCache::prune() const noexcept {
+  llvm::CachePruningPolicy policy;
+  policy.Interval = std::chrono::seconds(0);
+  policy.Expiration = std::chrono::hours(7 * 24);
+  policy.MaxSizeBytes = this->maxSizeBytes;
+  llvm::pruneCache(this->directory, policy);
+}
+
+void CompilationCache::printStatistics(llvm::raw_ostream &os) const noexcept {
+  unsigned total = this->hits + this->misses;
+  unsigned hitRate = total ? this->hits * 100 / total : 0;
+  os << "cache: " << this->hits << " hits, " << this->misses << " misses ("
+     << hitRate << "% hit rate)\n";
+}
+
+std::string hashFunctionModule(const llvm::Module &module,
+                               const CodeGenOptions &options) noexcept {
+  llvm::SHA256 hasher;
+  hasher.update(cacheVersion);
+  hasher.update(LLVM_VERSION_STRING);
+  hasher.update(module.getTargetTriple().str());
+  hasher.update(options.cpu);
+  hasher.update(options.features);
+  hasher.update(std::to_string(options.optLevel));
+  hasher.update(std::to_string(options.sizeLevel));
+
+  // The textual IR of the module includes the function body, the declarations
+  // of its callees and the attribute groups.
+  std::string ir;
+  llvm::raw_string_ostream os(ir);
+  module.print(os, nullptr);
+  hasher.update(ir);
+
+  return llvm::toHex(hasher.final(), /*LowerCase=*/true);
+}
+
+} // namespace gen
+} // namespace monty
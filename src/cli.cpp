@@ -1,5 +1,6 @@
 #include "../include/cli.hpp"
 #include <iostream>
+#include <stdexcept>
 #include <vector>
 
 namespace monty {
@@ -8,10 +9,68 @@ namespace drv {
 Cli::Cli(int argc, char *argv[]) { parse(argc, argv); }
 
 void Cli::print_usage(const char *prog_name) const {
-  std::cout << "Usage: " << prog_name << " [source_file] [options]\n"
+  std::cout << "Usage: " << prog_name << " [source_files...] [options]\n"
             << "Options:\n"
             << "  -o <path>      Specify the output file path\n"
             << "  -c             Compile to object file only (do not link)\n"
+            << "  --emit=<kind>  Output kind: obj (default), llvm-bc for\n"
+            << "                 -flto or thin-bc for -flto=thin links with\n"
+            << "                 clang; bitcode is never linked\n"
+            << "  --run          JIT compile and run entry(), do not link\n"
+            << "  --runtime <path>\n"
+            << "                 Runtime library to link against (default:\n"
+            << "                 the monty_rt library installed with montyc)\n"
+            << "  -O<level>      Optimization level: 0, 1, 2, 3, s or z\n"
+            << "  --cpu <name>   Target CPU, 'native' selects the host CPU\n"
+            << "  -march=<name>  Alias for --cpu <name>\n"
+            << "  --target-features <list>\n"
+            << "                 Comma separated features, e.g. +avx2,+fma\n"
+            << "  -j <threads>   Worker threads compiling source files and\n"
+            << "                 module partitions (0 = all cores)\n"
+            << "  --cache-dir <dir>\n"
+            << "                 Reuse compiled functions kept in <dir>. Each\n"
+            << "                 function is still parsed and generated, its\n"
+            << "                 key is a hash of its IR. Functions are\n"
+            << "                 optimized in isolation, only operators are\n"
+            << "                 inlined into them, so code is slower\n"
+            << "  --cache-max-size <MiB>\n"
+            << "                 Size limit of the cache (default 1024),\n"
+            << "                 entries unused for a week are evicted too\n"
+            << "  --cache-stats  Print cache hit and miss counts\n"
+            << "  --time-report  Print time spent in each compilation phase\n"
+            << "  --stats-json=<file>\n"
+            << "                 Write timings and statistics as JSON\n"
+            << "  --print-ir     Print the IR of every function to stderr\n"
+            << "  --export-operators\n"
+            << "                 Export operator functions from the objects\n"
+            << "  --whole-program\n"
+            << "                 Optimize all source files as one program,\n"
+            << "                 only entry() and --export functions stay\n"
+            << "                 visible\n"
+            << "  --export <name>\n"
+            << "                 Keep <name> visible in --whole-program mode\n"
+            << "  --profile-generate[=<file>]\n"
+            << "                 Instrument the program to write a profile\n"
+            << "                 to <file> (default default_%m.profraw)\n"
+            << "  --profile-use=<file>\n"
+            << "                 Optimize with the profile merged into <file>\n"
+            << "                 by llvm-profdata\n"
+            << "  -ffast-math    Allow every floating point optimization that\n"
+            << "                 ignores NaNs, infinities, signed zeros and\n"
+            << "                 rounding, implies --fp-contract=fast\n"
+            << "  --fp-contract <mode>\n"
+            << "                 Fuse products and sums: off (default), on\n"
+            << "                 within an expression, or fast\n"
+            << "  --fp-flags <list>\n"
+            << "                 Comma separated fast-math flags: nnan, ninf,\n"
+            << "                 nsz, reassoc and contract\n"
+            << "                 Functions annotated 'fast' or 'strict'\n"
+            << "                 ignore the three options above\n"
+            << "  --const-eval-steps <n>\n"
+            << "                 Evaluate calls of pure functions with\n"
+            << "                 constant arguments at compile time if they\n"
+            << "                 finish within <n> steps (default 1000000,\n"
+            << "                 0 = off)\n"
             << "  --help         Display this information\n";
 }
 
@@ -32,21 +91,231 @@ void Cli::parse(int argc, char *argv[]) {
       }
     } else if (arg == "-c") {
       compile_only = true;
+    } else if (arg == "--emit") {
+      if (i + 1 < args.size()) {
+        emit = args[++i];
+      } else {
+        throw std::runtime_error("Error: --emit requires an output kind.");
+      }
+    } else if (arg.rfind("--emit=", 0) == 0) {
+      emit = arg.substr(7);
+    } else if (arg == "-j") {
+      if (i + 1 < args.size()) {
+        jobs = parseUnsigned(args[++i], "thread count");
+      } else {
+        throw std::runtime_error("Error: -j requires a thread count.");
+      }
+    } else if (arg.rfind("-j", 0) == 0) {
+      jobs = parseUnsigned(arg.substr(2), "thread count");
+    } else if (arg == "--cache-dir") {
+      if (i + 1 < args.size()) {
+        cache_dir = args[++i];
+      } else {
+        throw std::runtime_error("Error: --cache-dir requires a directory.");
+      }
+    } else if (arg == "--cache-max-size") {
+      if (i + 1 < args.size()) {
+        cache_max_size = parseUnsigned(args[++i], "cache size");
+      } else {
+        throw std::runtime_error("Error: --cache-max-size requires a size.");
+      }
+    } else if (arg == "--cache-stats") {
+      cache_stats = true;
+    } else if (arg == "--time-report") {
+      time_report = true;
+    } else if (arg == "--stats-json") {
+      if (i + 1 < args.size()) {
+        stats_json = args[++i];
+      } else {
+        throw std::runtime_error("Error: --stats-json requires a file path.");
+      }
+    } else if (arg.rfind("--stats-json=", 0) == 0) {
+      stats_json = arg.substr(13);
+    } else if (arg == "--print-ir") {
+      print_ir = true;
+    } else if (arg == "--export-operators") {
+      export_operators = true;
+    } else if (arg == "--whole-program") {
+      whole_program = true;
+    } else if (arg == "--export") {
+      if (i + 1 < args.size()) {
+        exports.push_back(args[++i]);
+      } else {
+        throw std::runtime_error("Error: --export requires a function name.");
+      }
+    } else if (arg == "--profile-generate") {
+      profile_generate = true;
+    } else if (arg.rfind("--profile-generate=", 0) == 0) {
+      profile_generate = true;
+      profile_file = arg.substr(19);
+    } else if (arg == "--profile-use") {
+      if (i + 1 < args.size()) {
+        profile_use = args[++i];
+      } else {
+        throw std::runtime_error("Error: --profile-use requires a file path.");
+      }
+    } else if (arg.rfind("--profile-use=", 0) == 0) {
+      profile_use = arg.substr(14);
+    } else if (arg == "-ffast-math" || arg == "--ffast-math") {
+      fast_math = true;
+    } else if (arg == "--fp-contract") {
+      if (i + 1 < args.size()) {
+        fp_contract = args[++i];
+      } else {
+        throw std::runtime_error("Error: --fp-contract requires a mode.");
+      }
+    } else if (arg.rfind("--fp-contract=", 0) == 0) {
+      fp_contract = arg.substr(14);
+    } else if (arg == "--fp-flags") {
+      if (i + 1 < args.size()) {
+        parseFPFlags(args[++i]);
+      } else {
+        throw std::runtime_error("Error: --fp-flags requires a flag list.");
+      }
+    } else if (arg.rfind("--fp-flags=", 0) == 0) {
+      parseFPFlags(arg.substr(11));
+    } else if (arg == "--const-eval-steps") {
+      if (i + 1 < args.size()) {
+        const_eval_steps = parseUnsigned(args[++i], "step count");
+      } else {
+        throw std::runtime_error(
+            "Error: --const-eval-steps requires a step count.");
+      }
+    } else if (arg == "--run") {
+      run_jit = true;
+    } else if (arg == "--runtime") {
+      if (i + 1 < args.size()) {
+        runtime_library = args[++i];
+      } else {
+        throw std::runtime_error("Error: --runtime requires a library path.");
+      }
+    } else if (arg.rfind("-O", 0) == 0) {
+      parseOptLevel(arg);
+    } else if (arg == "--cpu") {
+      if (i + 1 < args.size()) {
+        cpu = args[++i];
+      } else {
+        throw std::runtime_error("Error: --cpu requires a CPU name.");
+      }
+    } else if (arg.rfind("-march=", 0) == 0) {
+      cpu = arg.substr(7);
+    } else if (arg == "--target-features") {
+      if (i + 1 < args.size()) {
+        target_features = args[++i];
+      } else {
+        throw std::runtime_error(
+            "Error: --target-features requires a feature list.");
+      }
     } else if (arg[0] == '-') {
       throw std::runtime_error("Unknown option: " + arg);
     } else {
-      // If it doesn't start with '-', assume it's the source file
-      if (source_file.empty()) {
-        source_file = arg;
-      } else {
-        throw std::runtime_error("Error: Multiple source files provided.");
-      }
+      // If it doesn't start with '-', assume it's a source file
+      source_files.push_back(arg);
     }
   }
 
-  if (source_file.empty() && !help_requested) {
+  if (source_files.empty() && !help_requested) {
     throw std::runtime_error("Error: No input source file specified.");
   }
+
+  if (emit != "obj" && emit != "llvm-bc" && emit != "thin-bc") {
+    throw std::runtime_error("Error: Invalid output kind: " + emit);
+  }
+  // Bitcode is written as one module and linked by the C++ toolchain
+  if (emit != "obj") {
+    if (run_jit || whole_program || !cache_dir.empty()) {
+      throw std::runtime_error("Error: --emit=" + emit +
+                               " cannot be combined with --run, "
+                               "--whole-program or --cache-dir.");
+    }
+    compile_only = true;
+  }
+
+  if (!fp_contract.empty() && fp_contract != "off" && fp_contract != "on" &&
+      fp_contract != "fast") {
+    throw std::runtime_error("Error: Invalid --fp-contract mode: " +
+                             fp_contract);
+  }
+
+  // The cache does not know the profile, the JIT does not write one
+  if (profile_generate || !profile_use.empty()) {
+    if (profile_generate && !profile_use.empty()) {
+      throw std::runtime_error("Error: --profile-generate cannot be combined "
+                               "with --profile-use.");
+    }
+    if (!cache_dir.empty()) {
+      throw std::runtime_error(
+          "Error: Profiles cannot be combined with --cache-dir.");
+    }
+    if (profile_generate && run_jit) {
+      throw std::runtime_error(
+          "Error: --profile-generate cannot be combined with --run.");
+    }
+  }
+
+  // Cached functions are compiled in isolation, the JIT compiles lazily
+  if (whole_program && !cache_dir.empty()) {
+    throw std::runtime_error(
+        "Error: --whole-program cannot be combined with --cache-dir.");
+  }
+  if (whole_program && run_jit) {
+    throw std::runtime_error(
+        "Error: --whole-program cannot be combined with --run.");
+  }
+
+  if (output_file.empty()) {
+    if (emit != "obj")
+      output_file = "output.bc";
+    else
+      output_file = compile_only ? "output.o" : "a.out";
+  }
+}
+
+unsigned Cli::parseUnsigned(const std::string &value, const char *what) {
+  try {
+    size_t end;
+    unsigned long result = std::stoul(value, &end);
+    if (end == value.size())
+      return result;
+  } catch (const std::exception &) {
+  }
+
+  throw std::runtime_error(std::string("Error: Invalid ") + what + ": " +
+                           value);
+}
+
+void Cli::parseFPFlags(const std::string &list) {
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string flag = list.substr(start, end - start);
+
+    if (flag != "nnan" && flag != "ninf" && flag != "nsz" &&
+        flag != "reassoc" && flag != "contract") {
+      throw std::runtime_error("Error: Invalid fast-math flag: " + flag);
+    }
+    fp_flags.push_back(flag);
+    start = end + 1;
+  }
+}
+
+void Cli::parseOptLevel(const std::string &arg) {
+  const std::string level = arg.substr(2);
+
+  if (level == "0" || level == "1" || level == "2" || level == "3") {
+    opt_level = level[0] - '0';
+    size_level = 0;
+  } else if (level == "s") {
+    opt_level = 2;
+    size_level = 1;
+  } else if (level == "z") {
+    opt_level = 2;
+    size_level = 2;
+  } else {
+    throw std::runtime_error("Error: Invalid optimization level: " + arg);
+  }
 }
 } // namespace drv
 } // namespace monty
@@ -11,5 +11,12 @@ void Diagnostics::printErors() const {
             err.message.c_str());
   }
 }
+
+void Diagnostics::printErors(const std::string &sourceFile) const {
+  for (const auto &err : this->errors) {
+    fprintf(stderr, "Error at %s:%d:%d: %s\n", sourceFile.c_str(),
+            err.loc.line, err.loc.col, err.message.c_str());
+  }
+}
 } // namespace syn
 } // namespace monty
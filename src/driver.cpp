@@ -1,20 +1,207 @@
 #include "../include/driver.hpp"
-#include <cstdlib>
+#include <lld/Common/Driver.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/ProfileData/InstrProf.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <stdexcept>
+#include <vector>
+
+LLD_HAS_DRIVER(elf)
 
 namespace monty {
 
 namespace drv {
-void linkToRuntime(const std::string &output) {
-  std::string command = "clang++ cpp-runtime/entry.cpp output.o -o " + output;
-  std::system(command.c_str());
+std::string defaultRuntimeLibrary(const char *argv0) {
+  static int anchor;
+  llvm::SmallString<128> exeDir(
+      llvm::sys::fs::getMainExecutable(argv0, &anchor));
+  llvm::sys::path::remove_filename(exeDir);
+
+  // Build tree layout: the runtime sits next to montyc.
+  llvm::SmallString<128> path(exeDir);
+  llvm::sys::path::append(path, MONTY_RUNTIME_NAME);
+  if (llvm::sys::fs::exists(path))
+    return std::string(path);
+
+  // Install layout: <prefix>/bin/montyc and <prefix>/lib/<runtime>.
+  path = exeDir;
+  llvm::sys::path::append(path, "..", "lib", MONTY_RUNTIME_NAME);
+  if (llvm::sys::fs::exists(path))
+    return std::string(path);
+
+  return "";
+}
+
+// lld only reads its inputs from disk, so in-memory objects are handed over
+// through uniquely named temporary files that are removed once linking is done.
+class TemporaryObjects {
+public:
+  ~TemporaryObjects() {
+    for (const std::string &path : this->paths)
+      llvm::sys::fs::remove(path);
+  }
+
+  void write(llvm::ArrayRef<gen::ObjectBuffer> objects) {
+    for (const gen::ObjectBuffer &object : objects) {
+      llvm::SmallString<128> path;
+      int fd;
+      if (auto ec = llvm::sys::fs::createTemporaryFile("monty", "o", fd, path))
+        throw std::runtime_error("Error: Could not create temporary file: " +
+                                 ec.message());
+      this->paths.push_back(std::string(path));
+
+      llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+      os.write(object.data(), object.size());
+    }
+  }
+
+  void appendTo(std::vector<const char *> &args) const {
+    for (const std::string &path : this->paths)
+      args.push_back(path.c_str());
+  }
+
+private:
+  std::vector<std::string> paths;
+};
+
+static void runLinker(llvm::ArrayRef<const char *> args,
+                      const std::string &output) {
+  lld::Result result = lld::lldMain(args, llvm::outs(), llvm::errs(),
+                                    {{lld::Gnu, &lld::elf::link}});
+  if (result.retCode != 0)
+    throw std::runtime_error("Error: Linking " + output + " failed.");
+}
+
+void linkToRuntime(llvm::ArrayRef<gen::ObjectBuffer> objects,
+                   const std::string &runtime, const std::string &output,
+                   bool profile) {
+  if (runtime.empty())
+    throw std::runtime_error("Error: Could not find the Monty runtime library, "
+                             "use --runtime <path>.");
+  if (profile && llvm::StringRef(MONTY_PROFILE_RUNTIME).empty())
+    throw std::runtime_error(
+        "Error: montyc was built without the compiler-rt profile runtime, "
+        "configure it with -DMONTY_PROFILE_RUNTIME=<path>.");
+
+  TemporaryObjects objectFiles;
+  objectFiles.write(objects);
+
+  std::vector<const char *> args = {"ld.lld",
+                                    "--eh-frame-hdr",
+                                    "-pie",
+                                    "-dynamic-linker",
+                                    MONTY_DYNAMIC_LINKER,
+                                    "-o",
+                                    output.c_str(),
+                                    MONTY_CRT1,
+                                    MONTY_CRTI,
+                                    MONTY_CRTBEGIN,
+                                    "-L" MONTY_LIBC_DIR};
+  objectFiles.appendTo(args);
+  args.push_back(runtime.c_str());
+
+  // Instrumented objects do not reference the profile runtime on Linux, the
+  // undefined hook variable pulls it out of the archive like clang does
+  std::string profileHook =
+      ("-u" + llvm::getInstrProfRuntimeHookVarName()).str();
+  if (profile) {
+    args.push_back(profileHook.c_str());
+    args.push_back(MONTY_PROFILE_RUNTIME);
+  }
+  args.insert(args.end(),
+              {MONTY_LIBGCC, "-lc", MONTY_LIBGCC, MONTY_CRTEND, MONTY_CRTN});
+
+  runLinker(args, output);
+}
+
+void linkRelocatable(llvm::ArrayRef<gen::ObjectBuffer> objects,
+                     const std::string &output) {
+  TemporaryObjects objectFiles;
+  objectFiles.write(objects);
+
+  std::vector<const char *> args = {"ld.lld", "-r", "-o", output.c_str()};
+  objectFiles.appendTo(args);
+
+  runLinker(args, output);
+}
+
+std::unique_ptr<CompilationUnit>
+compileSource(const std::string &sourceFile, const gen::CodeGenOptions &options,
+              const FrontendOptions &frontend) noexcept {
+  // Large files are memory mapped, the lexer works on the buffer in place
+  auto source = llvm::MemoryBuffer::getFile(sourceFile, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!source) {
+    llvm::errs() << "Error could not open file " << sourceFile << ": "
+                 << source.getError().message() << '\n';
+    return nullptr;
+  }
+
+  auto unit = std::make_unique<CompilationUnit>();
+  unit->sourceFile = sourceFile;
+  unit->generator = std::make_unique<gen::CodeGenerator>(unit->symbols, options,
+                                                        frontend.stats);
+  if (!unit->generator->valid())
+    return nullptr;
+  // Profiles name local functions, e.g. operators, after the source file
+  unit->generator->llvmModule->setSourceFileName(sourceFile);
+
+  // Error tracker
+  syn::Diagnostics diag;
+  syn::Parser parser{diag, unit->symbols, (*source)->getBuffer()};
+  parser.getNextToken();
+
+  process(*unit->generator, parser, frontend);
+
+  if (diag.hasErrors()) {
+    diag.printErors(sourceFile);
+    return nullptr;
+  }
+  // Code generation errors have been printed already; the module lacks the
+  // functions that failed
+  if (unit->generator->hasErrors())
+    return nullptr;
+
+  return unit;
 }
 
-void cleanUp(const std::string &objectFile) {
-  std::string command = "rm " + objectFile;
-  std::system(command.c_str());
+bool linkUnits(
+    llvm::ArrayRef<std::unique_ptr<CompilationUnit>> units) noexcept {
+  gen::CodeGenerator &first = *units.front()->generator;
+  llvm::Linker linker(*first.llvmModule);
+
+  // Every unit has a context of its own, modules move over as bitcode. Local
+  // symbols such as operators are renamed if they clash.
+  for (const auto &unit : units.drop_front()) {
+    llvm::SmallVector<char, 0> bitcode;
+    llvm::raw_svector_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(*unit->generator->llvmModule, os);
+    unit->generator->llvmModule.reset();
+
+    llvm::MemoryBufferRef buffer(
+        llvm::StringRef(bitcode.data(), bitcode.size()), unit->sourceFile);
+    auto module = llvm::parseBitcodeFile(buffer, *first.llvmContext);
+    if (!module) {
+      llvm::logAllUnhandledErrors(module.takeError(), llvm::errs());
+      return false;
+    }
+    if (linker.linkInModule(std::move(*module))) {
+      llvm::errs() << "Error: Could not link " << unit->sourceFile
+                   << " into the program\n";
+      return false;
+    }
+  }
+  return true;
 }
 
-void process(gen::CodeGenerator &generator, syn::Parser &parser) noexcept {
+void process(gen::CodeGenerator &generator, syn::Parser &parser,
+             const FrontendOptions &frontend) noexcept {
   while (true) {
     switch (parser.getCurrentToken()) {
     case syn::token_eof:
@@ -23,25 +210,39 @@ void process(gen::CodeGenerator &generator, syn::Parser &parser) noexcept {
       parser.getNextToken();
       break;
     case syn::token_def:
-      handleDefinition(generator, parser);
+      handleDefinition(generator, parser, frontend);
       break;
     case syn::token_extern:
-      handleExtern(generator, parser);
+      handleExtern(generator, parser, frontend);
       break;
     default:
-      handleTopLevelExpression(generator, parser);
+      handleTopLevelExpression(generator, parser, frontend);
       break;
     }
+
+    // The item has been lowered to IR, its expressions are no longer needed
+    if (frontend.stats)
+      frontend.stats->expressions += parser.getExprPool().size();
+    parser.resetExprPool();
   }
 }
 
-void handleExtern(gen::CodeGenerator &generator, syn::Parser &parser) noexcept {
-  if (auto protoAST = parser.parseExtern()) {
-    generator.visit(*protoAST);
-    if (auto *fnIR = generator.getLastFunctionValue()) {
-      fprintf(stderr, "Read extern: ");
-      fnIR->print(llvm::errs());
-      fprintf(stderr, "\n");
+void handleExtern(gen::CodeGenerator &generator, syn::Parser &parser,
+                  const FrontendOptions &frontend) noexcept {
+  stats::PhaseTimer parseTimer(frontend.stats, stats::Phase::Parse);
+  auto protoAST = parser.parseExtern();
+  parseTimer.stop();
+
+  if (protoAST) {
+    if (frontend.stats)
+      ++frontend.stats->externs;
+
+    if (auto *fnIR = generator.emitPrototype(*protoAST)) {
+      if (frontend.printIR) {
+        fprintf(stderr, "Read extern: ");
+        fnIR->print(llvm::errs());
+        fprintf(stderr, "\n");
+      }
 
       generator.functionPrototypes[protoAST->getName()] = std::move(protoAST);
     }
@@ -50,12 +251,18 @@ void handleExtern(gen::CodeGenerator &generator, syn::Parser &parser) noexcept {
     parser.synchronize();
   }
 }
-void handleDefinition(gen::CodeGenerator &generator,
-                      syn::Parser &parser) noexcept {
-  if (auto fnAST = parser.parseDefinition()) {
-    generator.visit(*fnAST);
+void handleDefinition(gen::CodeGenerator &generator, syn::Parser &parser,
+                      const FrontendOptions &frontend) noexcept {
+  stats::PhaseTimer parseTimer(frontend.stats, stats::Phase::Parse);
+  auto fnAST = parser.parseDefinition();
+  parseTimer.stop();
 
-    if (auto *fnIR = generator.getLastFunctionValue()) {
+  if (fnAST) {
+    if (frontend.stats)
+      ++frontend.stats->functions;
+
+    auto *fnIR = generator.emitFunction(*fnAST, parser.getExprPool());
+    if (fnIR && frontend.printIR) {
       fprintf(stderr, "Read function definition:");
       fnIR->print(llvm::errs());
       fprintf(stderr, "\n");
@@ -66,10 +273,18 @@ void handleDefinition(gen::CodeGenerator &generator,
   }
 }
 void handleTopLevelExpression(gen::CodeGenerator &generator,
-                              syn::Parser &parser) noexcept {
+                              syn::Parser &parser,
+                              const FrontendOptions &frontend) noexcept {
+  stats::PhaseTimer parseTimer(frontend.stats, stats::Phase::Parse);
+  auto fnAST = parser.parseTopLevelExpr();
+  parseTimer.stop();
+
   // Evaluate a top-level expression into an anonymous function.
-  if (auto fnAST = parser.parseTopLevelExpr()) {
-    generator.visit(*fnAST);
+  if (fnAST) {
+    if (frontend.stats)
+      ++frontend.stats->functions;
+
+    generator.emitFunction(*fnAST, parser.getExprPool());
   } else {
     // Error encountered, synchronize for recovery
     parser.synchronize();
@@ -0,0 +1,435 @@
+#include "../include/emitter.hpp"
+#include <algorithm>
+#include <atomic>
+#include <llvm/ADT/Any.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Bitcode/BitcodeWriterPass.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/Pass.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Transforms/IPO/ThinLTOBitcodeWriter.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+
+namespace monty {
+namespace gen {
+
+// Number of function definitions compiled together in one partition, and the
+// upper bound on partitions for very large modules.
+static constexpr unsigned functionsPerPartition = 256;
+static constexpr unsigned maxPartitions = 64;
+
+static unsigned getPartitionCount(const llvm::Module &module) noexcept {
+  unsigned definitions = 0;
+  for (const llvm::Function &function : module)
+    if (!function.isDeclaration())
+      ++definitions;
+
+  return std::clamp(definitions / functionsPerPartition, 1u, maxPartitions);
+}
+
+// Loops of `function` that the loop vectorizer turned into vector code: they
+// are marked as vectorized and compute on vectors, unlike the scalar remainder
+// loops the vectorizer marks as well.
+static unsigned countVectorizedLoops(llvm::Function &function) {
+  llvm::DominatorTree dominators(function);
+  llvm::LoopInfo loopInfo(dominators);
+  auto isVector = [](const llvm::Instruction &inst) {
+    return inst.getType()->isVectorTy();
+  };
+
+  unsigned count = 0;
+  for (const llvm::Loop *loop : loopInfo.getLoopsInPreorder()) {
+    if (!llvm::getBooleanLoopAttribute(loop, "llvm.loop.isvectorized"))
+      continue;
+    for (const llvm::BasicBlock *block : loop->blocks()) {
+      if (llvm::any_of(*block, isVector)) {
+        ++count;
+        break;
+      }
+    }
+  }
+  return count;
+}
+
+// The function the loop vectorizer is about to run or has run on, if `pass`
+// is the loop vectorizer
+static llvm::Function *getVectorizedFunction(llvm::StringRef pass,
+                                             const llvm::Any &ir) noexcept {
+  if (pass != "LoopVectorizePass")
+    return nullptr;
+  auto *function = llvm::any_cast<const llvm::Function *>(&ir);
+  return function ? const_cast<llvm::Function *>(*function) : nullptr;
+}
+
+// Counts the loops the loop vectorizer transformed in the pipelines run with
+// its callbacks and adds them to `stats` when it is destroyed. Loops are only
+// counted when statistics are collected, before and after each run of the
+// vectorizer.
+class VectorizationCounter {
+public:
+  explicit VectorizationCounter(stats::Statistics *_stats) : stats(_stats) {
+    if (!this->stats)
+      return;
+    this->callbacks.registerBeforeNonSkippedPassCallback(
+        [this](llvm::StringRef pass, llvm::Any ir) {
+          if (llvm::Function *function = getVectorizedFunction(pass, ir))
+            this->before = countVectorizedLoops(*function);
+        });
+    this->callbacks.registerAfterPassCallback(
+        [this](llvm::StringRef pass, llvm::Any ir,
+               const llvm::PreservedAnalyses &) {
+          llvm::Function *function = getVectorizedFunction(pass, ir);
+          if (!function)
+            return;
+          unsigned after = countVectorizedLoops(*function);
+          if (after > this->before)
+            this->loops += after - this->before;
+        });
+  }
+  ~VectorizationCounter() {
+    if (this->stats)
+      this->stats->vectorizedLoops += this->loops;
+  }
+
+  // Callbacks to build the pass pipeline with, null if nothing is counted
+  llvm::PassInstrumentationCallbacks *getCallbacks() noexcept {
+    return this->stats ? &this->callbacks : nullptr;
+  }
+
+private:
+  stats::Statistics *stats;
+  llvm::PassInstrumentationCallbacks callbacks;
+  unsigned before = 0;
+  unsigned loops = 0;
+};
+
+// Adds the time every function took to be emitted to `stats`. The code
+// generator runs its passes function by function in one pass manager, this
+// pass runs after them and charges the time since its previous run to the
+// function it runs on. The first function is also charged for the module
+// passes in front of the code generator's.
+class CodeGenTimer : public llvm::FunctionPass {
+public:
+  static char ID;
+
+  explicit CodeGenTimer(stats::Statistics *_stats) noexcept
+      : llvm::FunctionPass(ID), stats(_stats) {}
+
+  llvm::StringRef getPassName() const override { return "Code Gen Timer"; }
+  void getAnalysisUsage(llvm::AnalysisUsage &usage) const override {
+    usage.setPreservesAll();
+  }
+
+  bool doInitialization(llvm::Module &) override {
+    this->last = stats::PhaseTime::now().wall;
+    return false;
+  }
+  bool runOnFunction(llvm::Function &function) override {
+    double now = stats::PhaseTime::now().wall;
+    this->stats->addFunctionTime(function.getName(), now - this->last);
+    this->last = now;
+    return false;
+  }
+
+private:
+  stats::Statistics *stats;
+  double last = 0;
+};
+
+char CodeGenTimer::ID = 0;
+
+// Optimize and emit a single module with a target machine of its own
+static bool compileModule(llvm::Module &module, const CodeGenOptions &options,
+                          ObjectBuffer &buffer,
+                          stats::Statistics *stats) noexcept {
+  auto targetMachine = createTargetMachine(module.getTargetTriple(), options);
+  if (!targetMachine)
+    return false;
+
+  // Whole programs have been optimized before they were split
+  if (!options.wholeProgram) {
+    stats::PhaseTimer timer(stats, stats::Phase::Optimize);
+    VectorizationCounter counter(stats);
+    optimizeModule(module, targetMachine.get(),
+                   options.getOptimizationLevel(), options.getPGOOptions(),
+                   counter.getCallbacks());
+  }
+
+  stats::PhaseTimer timer(stats, stats::Phase::CodeGen);
+  return emitObject(module, *targetMachine, buffer, stats);
+}
+
+// Load a module serialized as bitcode into a fresh context, then optimize and
+// emit it. Used to compile on worker threads independently of the module's
+// original context.
+static bool compileBitcode(llvm::ArrayRef<char> bitcode,
+                           const CodeGenOptions &options, ObjectBuffer &buffer,
+                           stats::Statistics *stats) noexcept {
+  llvm::LLVMContext context;
+  llvm::MemoryBufferRef bitcodeBuffer(
+      llvm::StringRef(bitcode.data(), bitcode.size()), "partition");
+
+  auto module = llvm::parseBitcodeFile(bitcodeBuffer, context);
+  if (!module) {
+    llvm::logAllUnhandledErrors(module.takeError(), llvm::errs());
+    return false;
+  }
+
+  return compileModule(**module, options, buffer, stats);
+}
+
+// Copy `function` into a module of its own, next to declarations of the
+// functions it calls. Callees that have to be inlined or are local to the
+// module, i.e. operators, are copied along with their bodies. Runs in time
+// proportional to the function, not the module it lives in.
+static std::unique_ptr<llvm::Module>
+extractFunction(const llvm::Function &function) noexcept {
+  const llvm::Module &module = *function.getParent();
+  auto part = std::make_unique<llvm::Module>(function.getName(),
+                                             function.getContext());
+  part->setTargetTriple(module.getTargetTriple());
+  part->setDataLayout(module.getDataLayout());
+
+  llvm::ValueToValueMapTy vmap;
+  auto createCopy = [&](const llvm::Function &source,
+                        llvm::GlobalValue::LinkageTypes linkage) {
+    llvm::Function *copy =
+        llvm::Function::Create(source.getFunctionType(), linkage,
+                               source.getName(), part.get());
+    vmap[&source] = copy;
+
+    auto copyArg = copy->arg_begin();
+    for (const llvm::Argument &arg : source.args()) {
+      copyArg->setName(arg.getName());
+      vmap[&arg] = &*copyArg++;
+    }
+  };
+
+  createCopy(function, function.getLinkage());
+  llvm::SmallVector<const llvm::Function *, 4> definitions = {&function};
+
+  for (size_t i = 0; i < definitions.size(); ++i) {
+    for (const llvm::BasicBlock &block : *definitions[i]) {
+      for (const llvm::Instruction &inst : block) {
+        auto *call = llvm::dyn_cast<llvm::CallBase>(&inst);
+        if (!call)
+          continue;
+
+        const llvm::Function *callee = call->getCalledFunction();
+        if (!callee || vmap.count(callee))
+          continue;
+
+        // Exported operators are only copied to be inlined, the definition
+        // that is linked in comes from their own object.
+        if (!callee->isDeclaration() &&
+            (callee->hasLocalLinkage() ||
+             callee->hasFnAttribute(llvm::Attribute::AlwaysInline))) {
+          createCopy(*callee, callee->hasLocalLinkage()
+                                  ? callee->getLinkage()
+                                  : llvm::Function::AvailableExternallyLinkage);
+          definitions.push_back(callee);
+          continue;
+        }
+
+        llvm::Function *declaration = llvm::Function::Create(
+            callee->getFunctionType(), llvm::Function::ExternalLinkage,
+            callee->getName(), part.get());
+        declaration->copyAttributesFrom(callee);
+        vmap[callee] = declaration;
+      }
+    }
+  }
+
+  for (const llvm::Function *definition : definitions) {
+    llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+    llvm::CloneFunctionInto(llvm::cast<llvm::Function>(vmap[definition]),
+                            definition, vmap,
+                            llvm::CloneFunctionChangeType::DifferentModule,
+                            returns);
+  }
+  return part;
+}
+
+bool emitObject(llvm::Module &module, llvm::TargetMachine &targetMachine,
+                ObjectBuffer &buffer, stats::Statistics *stats) noexcept {
+  llvm::raw_svector_ostream dest(buffer);
+
+  llvm::legacy::PassManager pass;
+  auto fileType = llvm::CodeGenFileType::ObjectFile;
+
+  if (targetMachine.addPassesToEmitFile(pass, dest, nullptr, fileType)) {
+    llvm::errs() << "TargetMachine can't emit a file of this type\n";
+    return false;
+  }
+  if (stats)
+    pass.add(new CodeGenTimer(stats));
+
+  pass.run(module);
+  return true;
+}
+
+bool emitBitcode(llvm::Module &module, const CodeGenOptions &options,
+                 BitcodeKind kind, llvm::raw_ostream &os,
+                 stats::Statistics *stats) noexcept {
+  auto targetMachine = createTargetMachine(module.getTargetTriple(), options);
+  if (!targetMachine)
+    return false;
+
+  stats::PhaseTimer timer(stats, stats::Phase::Optimize);
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  llvm::PassBuilder pb(targetMachine.get(), llvm::PipelineTuningOptions(),
+                       options.getPGOOptions());
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  // The pre-link pipelines leave inlining across modules and most loop
+  // transformations to the link, like clang does for -flto
+  llvm::OptimizationLevel level = options.getOptimizationLevel();
+  llvm::ModulePassManager mpm;
+  if (kind == BitcodeKind::Thin) {
+    mpm.addPass(pb.buildThinLTOPreLinkDefaultPipeline(level));
+    mpm.addPass(llvm::ThinLTOBitcodeWriterPass(os, nullptr));
+  } else {
+    // The summary is kept for the linker's symbol resolution, the flag stops
+    // it from treating the module as ThinLTO
+    module.addModuleFlag(llvm::Module::Error, "ThinLTO", uint32_t(0));
+    mpm.addPass(pb.buildLTOPreLinkDefaultPipeline(level));
+    mpm.addPass(llvm::BitcodeWriterPass(os, /*PreserveUseListOrder=*/false,
+                                        /*EmitSummaryIndex=*/true));
+  }
+  mpm.run(module, mam);
+  return true;
+}
+
+std::vector<ObjectBuffer> emitObjects(llvm::Module &module,
+                                      const CodeGenOptions &options,
+                                      unsigned threads,
+                                      stats::Statistics *stats) noexcept {
+  // The interprocedural passes need to see the whole module, only code
+  // generation is split up then
+  if (options.wholeProgram) {
+    stats::PhaseTimer timer(stats, stats::Phase::Optimize);
+    auto targetMachine = createTargetMachine(module.getTargetTriple(), options);
+    if (!targetMachine)
+      return {};
+    VectorizationCounter counter(stats);
+    optimizeWholeProgram(module, targetMachine.get(), options,
+                         counter.getCallbacks());
+  }
+
+  unsigned partitions = getPartitionCount(module);
+  std::vector<ObjectBuffer> objects(partitions);
+
+  if (partitions == 1) {
+    if (!compileModule(module, options, objects[0], stats))
+      return {};
+    return objects;
+  }
+
+  // Operators are only inlined where their definition is visible, which after
+  // splitting is a single partition
+  {
+    stats::PhaseTimer timer(stats, stats::Phase::Optimize);
+    inlineOperators(module);
+  }
+
+  // Partitions share the context of `module`, so each one is serialized to
+  // bitcode and parsed again into a fresh context on its worker thread. Work
+  // starts as soon as a partition has been split off.
+  std::vector<llvm::SmallVector<char, 0>> bitcode(partitions);
+  std::atomic<bool> failed{false};
+  unsigned next = 0;
+
+  auto compilePartition = [&](unsigned index) {
+    if (!compileBitcode(bitcode[index], options, objects[index], stats))
+      failed = true;
+  };
+
+  llvm::DefaultThreadPool pool(llvm::hardware_concurrency(threads));
+  llvm::SplitModule(module, partitions,
+                    [&](std::unique_ptr<llvm::Module> partition) {
+                      unsigned index = next++;
+                      llvm::raw_svector_ostream os(bitcode[index]);
+                      llvm::WriteBitcodeToFile(*partition, os);
+                      pool.async(compilePartition, index);
+                    });
+  pool.wait();
+
+  if (failed)
+    return {};
+  return objects;
+}
+
+std::vector<ObjectBuffer> emitCachedObjects(llvm::Module &module,
+                                            const CodeGenOptions &options,
+                                            CompilationCache &cache,
+                                            unsigned threads,
+                                            stats::Statistics *stats) noexcept {
+  std::vector<ObjectBuffer> objects;
+  std::vector<std::pair<size_t, std::string>> missed;
+  std::vector<llvm::SmallVector<char, 0>> bitcode;
+
+  // Every function is looked up by the hash of its own module. Misses are
+  // serialized for the workers, since they share the context of `module`.
+  for (const llvm::Function &function : module) {
+    // Local functions are copied into the modules of their callers instead
+    if (function.isDeclaration() || function.hasLocalLinkage())
+      continue;
+
+    std::unique_ptr<llvm::Module> part = extractFunction(function);
+    std::string key = hashFunctionModule(*part, options);
+
+    objects.emplace_back();
+    if (auto cached = cache.lookup(key)) {
+      objects.back().assign(cached->getBufferStart(), cached->getBufferEnd());
+      continue;
+    }
+
+    missed.emplace_back(objects.size() - 1, std::move(key));
+    bitcode.emplace_back();
+    llvm::raw_svector_ostream os(bitcode.back());
+    llvm::WriteBitcodeToFile(*part, os);
+  }
+
+  // Nothing but declarations and local functions, emit the module as a whole
+  if (objects.empty())
+    return emitObjects(module, options, threads, stats);
+
+  std::atomic<bool> failed{false};
+  llvm::DefaultThreadPool pool(llvm::hardware_concurrency(threads));
+  for (size_t i = 0; i < missed.size(); ++i) {
+    pool.async([&, i] {
+      auto &[index, key] = missed[i];
+      if (!compileBitcode(bitcode[i], options, objects[index], stats)) {
+        failed = true;
+        return;
+      }
+      cache.store(key, objects[index]);
+    });
+  }
+  pool.wait();
+
+  if (failed)
+    return {};
+  return objects;
+}
+
+} // namespace gen
+} // namespace monty
@@ -0,0 +1,486 @@
+#include "../include/evaluator.hpp"
+#include <cmath>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/bit.h>
+#include <llvm/Support/ErrorHandling.h>
+
+namespace monty {
+namespace eval {
+
+// Expressions nested deeper, counting the bodies of calls, are left to run
+// time: evaluating them would exhaust the compiler's stack, which is a worker
+// thread's when several files are compiled at once
+static constexpr unsigned maxDepth = 2048;
+
+// `if` takes the `then` branch for ordered, non-zero conditions, like the
+// `fcmp one` emitted by the generator
+static bool isTrue(double cond) noexcept {
+  return !std::isnan(cond) && cond != 0.0;
+}
+
+// Iterations of a `for` loop, computed like the generator does: the step is
+// taken ceil((end - start) / step) times, which is never negative and 0 if
+// the quotient is not finite. Counts beyond int64_t saturate.
+static int64_t getTripCount(double start, double end, double step) noexcept {
+  double count = std::ceil((end - start) / step);
+  if (!(count > 0) || std::isinf(count))
+    return 0;
+  if (count >= 0x1p63)
+    return INT64_MAX;
+  return static_cast<int64_t>(count);
+}
+
+ConstantEvaluator::ConstantEvaluator(ast::Interner &_symbols,
+                                     uint64_t _stepBudget) noexcept
+    : symbols(_symbols), stepBudget(_stepBudget) {
+  this->assignOp = this->symbols.intern("=");
+  this->addOp = this->symbols.intern("+");
+  this->subOp = this->symbols.intern("-");
+  this->mulOp = this->symbols.intern("*");
+  this->lessOp = this->symbols.intern("<");
+}
+
+ast::Symbol ConstantEvaluator::getOperatorFunction(const char *prefix,
+                                                   ast::Symbol op) {
+  llvm::SmallString<16> name(prefix);
+  name += this->symbols.getName(op);
+  return this->symbols.intern(name);
+}
+
+bool ConstantEvaluator::isBuiltin(ast::Symbol op) const noexcept {
+  return op == this->addOp || op == this->subOp || op == this->mulOp ||
+         op == this->lessOp;
+}
+
+void ConstantEvaluator::define(const ast::FunctionPrototypeAST &proto,
+                               const ast::ExprPool &pool, ast::ExprRef body) {
+  if (this->stepBudget == 0)
+    return;
+
+  // Results of calls that reached the previous body are stale
+  if (this->functions.count(proto.getName()))
+    this->calls.clear();
+
+  // A redefinition replaces the previous body, even if it was pure. Only
+  // doubles are evaluated, functions on vectors are left to run time.
+  if (proto.usesVectors() || !isPure(pool, body, proto.getName())) {
+    this->functions.erase(proto.getName());
+    return;
+  }
+
+  PureFunction function;
+  function.params.assign(proto.getArgs().begin(), proto.getArgs().end());
+  function.body = copy(pool, body);
+  this->functions[proto.getName()] = std::move(function);
+}
+
+bool ConstantEvaluator::isPure(const ast::ExprPool &pool, ast::ExprRef ref,
+                               ast::Symbol self) {
+  auto isPureFunction = [&](ast::Symbol name) {
+    return name == self || this->functions.count(name);
+  };
+
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+  case ast::ExprKind::Variable:
+    return true;
+  case ast::ExprKind::Unary: {
+    const ast::UnaryExprAST &node = pool.getUnary(ref);
+    return isPureFunction(getOperatorFunction("unary", node.opcode)) &&
+           isPure(pool, node.operand, self);
+  }
+  case ast::ExprKind::Binary: {
+    const ast::BinaryExprAST &node = pool.getBinary(ref);
+    // Assignments only change local variables
+    if (node.op == this->assignOp)
+      return node.Lhs.getKind() == ast::ExprKind::Variable &&
+             isPure(pool, node.Rhs, self);
+    if (!isBuiltin(node.op) &&
+        !isPureFunction(getOperatorFunction("binary", node.op)))
+      return false;
+    return isPure(pool, node.Lhs, self) && isPure(pool, node.Rhs, self);
+  }
+  case ast::ExprKind::If: {
+    const ast::IfExprAST &node = pool.getIf(ref);
+    return isPure(pool, node.cond, self) && isPure(pool, node.then, self) &&
+           isPure(pool, node.otherwise, self);
+  }
+  case ast::ExprKind::Let: {
+    const ast::LetExprAST &node = pool.getLet(ref);
+    for (const ast::LetBinding &binding : pool.getBindings(node))
+      if (binding.init && !isPure(pool, binding.init, self))
+        return false;
+    return isPure(pool, node.body, self);
+  }
+  case ast::ExprKind::Call: {
+    const ast::FunctionCallExprAST &node = pool.getCall(ref);
+    if (!isPureFunction(node.caller))
+      return false;
+    for (ast::ExprRef arg : pool.getArgs(node))
+      if (!isPure(pool, arg, self))
+        return false;
+    return true;
+  }
+  case ast::ExprKind::For: {
+    const ast::ForExprAST &node = pool.getFor(ref);
+    return isPure(pool, node.start, self) && isPure(pool, node.end, self) &&
+           (!node.step || isPure(pool, node.step, self)) &&
+           (!node.init || isPure(pool, node.init, self)) &&
+           isPure(pool, node.body, self);
+  }
+  case ast::ExprKind::Vector:
+  case ast::ExprKind::Index:
+    return false;
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+ast::ExprRef ConstantEvaluator::copy(const ast::ExprPool &pool,
+                                     ast::ExprRef ref) {
+  if (!ref)
+    return ast::ExprRef();
+
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+    return this->library.addNumber(pool.getNumber(ref).val);
+  case ast::ExprKind::Variable:
+    return this->library.addVariable(pool.getVariable(ref).name);
+  case ast::ExprKind::Unary: {
+    const ast::UnaryExprAST &node = pool.getUnary(ref);
+    ast::ExprRef operand = copy(pool, node.operand);
+    return this->library.addCall(getOperatorFunction("unary", node.opcode),
+                                 operand);
+  }
+  case ast::ExprKind::Binary: {
+    const ast::BinaryExprAST &node = pool.getBinary(ref);
+    ast::ExprRef operands[] = {copy(pool, node.Lhs), copy(pool, node.Rhs)};
+    if (node.op == this->assignOp || isBuiltin(node.op))
+      return this->library.addBinary(node.op, operands[0], operands[1]);
+    return this->library.addCall(getOperatorFunction("binary", node.op),
+                                 operands);
+  }
+  case ast::ExprKind::If: {
+    const ast::IfExprAST &node = pool.getIf(ref);
+    ast::ExprRef cond = copy(pool, node.cond);
+    ast::ExprRef then = copy(pool, node.then);
+    ast::ExprRef otherwise = copy(pool, node.otherwise);
+    return this->library.addIf(cond, then, otherwise);
+  }
+  case ast::ExprKind::Let: {
+    const ast::LetExprAST &node = pool.getLet(ref);
+    llvm::SmallVector<ast::LetBinding, 4> bindings;
+    for (const ast::LetBinding &binding : pool.getBindings(node))
+      bindings.push_back({binding.name, copy(pool, binding.init)});
+    ast::ExprRef body = copy(pool, node.body);
+    return this->library.addLet(bindings, body);
+  }
+  case ast::ExprKind::Call: {
+    const ast::FunctionCallExprAST &node = pool.getCall(ref);
+    llvm::SmallVector<ast::ExprRef, 4> args;
+    for (ast::ExprRef arg : pool.getArgs(node))
+      args.push_back(copy(pool, arg));
+    return this->library.addCall(node.caller, args);
+  }
+  case ast::ExprKind::For: {
+    ast::ForExprAST node = pool.getFor(ref);
+    node.start = copy(pool, node.start);
+    node.end = copy(pool, node.end);
+    node.step = copy(pool, node.step);
+    node.init = copy(pool, node.init);
+    node.body = copy(pool, node.body);
+    return this->library.addFor(node);
+  }
+  case ast::ExprKind::Vector:
+  case ast::ExprKind::Index:
+    llvm_unreachable("vectors are not pure");
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+unsigned ConstantEvaluator::fold(const ast::ExprPool &pool,
+                                 ast::ExprRef body) {
+  this->folded.clear();
+  this->foldedCalls = 0;
+  if (this->stepBudget != 0)
+    foldExpr(pool, body);
+  return this->foldedCalls;
+}
+
+// Returns the value of `ref` if it does not depend on any variable. All
+// sub-expressions are visited, so calls nested in non-constant expressions are
+// folded as well.
+std::optional<double> ConstantEvaluator::foldExpr(const ast::ExprPool &pool,
+                                                  ast::ExprRef ref) {
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+    return pool.getNumber(ref).val;
+  case ast::ExprKind::Variable:
+    return std::nullopt;
+  case ast::ExprKind::Unary: {
+    const ast::UnaryExprAST &node = pool.getUnary(ref);
+    std::optional<double> operand = foldExpr(pool, node.operand);
+    if (!operand)
+      return std::nullopt;
+    return foldCall(ref, getOperatorFunction("unary", node.opcode), *operand);
+  }
+  case ast::ExprKind::Binary: {
+    const ast::BinaryExprAST &node = pool.getBinary(ref);
+    if (node.op == this->assignOp) {
+      foldExpr(pool, node.Rhs);
+      return std::nullopt;
+    }
+
+    std::optional<double> lhs = foldExpr(pool, node.Lhs);
+    std::optional<double> rhs = foldExpr(pool, node.Rhs);
+    if (!lhs || !rhs)
+      return std::nullopt;
+    // Built-in operators over constants are folded by the IR builder
+    if (isBuiltin(node.op))
+      return applyBuiltin(node.op, *lhs, *rhs);
+    double args[] = {*lhs, *rhs};
+    return foldCall(ref, getOperatorFunction("binary", node.op), args);
+  }
+  case ast::ExprKind::If: {
+    const ast::IfExprAST &node = pool.getIf(ref);
+    std::optional<double> cond = foldExpr(pool, node.cond);
+    std::optional<double> then = foldExpr(pool, node.then);
+    std::optional<double> otherwise = foldExpr(pool, node.otherwise);
+    if (!cond)
+      return std::nullopt;
+    return isTrue(*cond) ? then : otherwise;
+  }
+  case ast::ExprKind::Let: {
+    const ast::LetExprAST &node = pool.getLet(ref);
+    for (const ast::LetBinding &binding : pool.getBindings(node))
+      if (binding.init)
+        foldExpr(pool, binding.init);
+    foldExpr(pool, node.body);
+    return std::nullopt;
+  }
+  case ast::ExprKind::Call: {
+    const ast::FunctionCallExprAST &node = pool.getCall(ref);
+    llvm::SmallVector<double, 4> args;
+    bool constant = true;
+    for (ast::ExprRef arg : pool.getArgs(node)) {
+      std::optional<double> value = foldExpr(pool, arg);
+      if (value)
+        args.push_back(*value);
+      else
+        constant = false;
+    }
+    if (!constant)
+      return std::nullopt;
+    return foldCall(ref, node.caller, args);
+  }
+  case ast::ExprKind::For: {
+    const ast::ForExprAST &node = pool.getFor(ref);
+    for (ast::ExprRef child :
+         {node.start, node.end, node.step, node.init, node.body})
+      if (child)
+        foldExpr(pool, child);
+    return std::nullopt;
+  }
+  case ast::ExprKind::Vector:
+    for (ast::ExprRef element : pool.getElements(pool.getVector(ref)))
+      foldExpr(pool, element);
+    return std::nullopt;
+  case ast::ExprKind::Index:
+    foldExpr(pool, pool.getIndex(ref).vector);
+    return std::nullopt;
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+std::optional<double> ConstantEvaluator::foldCall(ast::ExprRef ref,
+                                                  ast::Symbol callee,
+                                                  llvm::ArrayRef<double> args) {
+  if (!this->functions.count(callee))
+    return std::nullopt;
+
+  std::pair<ast::Symbol, std::vector<uint64_t>> key{callee, {}};
+  for (double arg : args)
+    key.second.push_back(llvm::bit_cast<uint64_t>(arg));
+  auto [memo, inserted] = this->calls.try_emplace(std::move(key));
+  if (inserted) {
+    this->stepsLeft = this->stepBudget;
+    this->depth = 0;
+    this->frame.clear();
+    this->frameBase = 0;
+    memo->second = call(callee, args);
+  }
+
+  std::optional<double> result = memo->second;
+  if (result) {
+    this->folded[ref.getOpaqueValue()] = *result;
+    ++this->foldedCalls;
+  }
+  return result;
+}
+
+double ConstantEvaluator::applyBuiltin(ast::Symbol op, double lhs,
+                                       double rhs) const noexcept {
+  if (op == this->addOp)
+    return lhs + rhs;
+  if (op == this->subOp)
+    return lhs - rhs;
+  if (op == this->mulOp)
+    return lhs * rhs;
+  // `<` is an unordered comparison, true if either side is NaN
+  assert(op == this->lessOp && "not a built-in operator");
+  return !(lhs >= rhs) ? 1.0 : 0.0;
+}
+
+std::optional<double> ConstantEvaluator::call(ast::Symbol callee,
+                                              llvm::ArrayRef<double> args) {
+  auto it = this->functions.find(callee);
+  if (it == this->functions.end() || it->second.params.size() != args.size())
+    return std::nullopt;
+  const PureFunction &function = it->second;
+
+  size_t callerBase = this->frameBase;
+  size_t callerSize = this->frame.size();
+  this->frameBase = callerSize;
+  for (size_t i = 0; i < args.size(); ++i)
+    this->frame.push_back({function.params[i], args[i]});
+
+  std::optional<double> result = evaluate(function.body);
+
+  this->frame.resize(callerSize);
+  this->frameBase = callerBase;
+  return result;
+}
+
+double *ConstantEvaluator::lookup(ast::Symbol name) noexcept {
+  for (size_t i = this->frame.size(); i-- > this->frameBase;)
+    if (this->frame[i].first == name)
+      return &this->frame[i].second;
+  return nullptr;
+}
+
+std::optional<double> ConstantEvaluator::evaluate(ast::ExprRef ref) {
+  if (this->stepsLeft == 0 || this->depth == maxDepth)
+    return std::nullopt;
+  --this->stepsLeft;
+
+  ++this->depth;
+  std::optional<double> result = evaluateNode(ref);
+  --this->depth;
+  return result;
+}
+
+std::optional<double> ConstantEvaluator::evaluateNode(ast::ExprRef ref) {
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+    return this->library.getNumber(ref).val;
+  case ast::ExprKind::Variable: {
+    double *value = lookup(this->library.getVariable(ref).name);
+    if (!value)
+      return std::nullopt;
+    return *value;
+  }
+  case ast::ExprKind::Unary:
+    llvm_unreachable("operators are stored as calls");
+  case ast::ExprKind::Binary: {
+    const ast::BinaryExprAST &node = this->library.getBinary(ref);
+    if (node.op == this->assignOp) {
+      std::optional<double> value = evaluate(node.Rhs);
+      if (!value)
+        return std::nullopt;
+      double *variable = lookup(this->library.getVariable(node.Lhs).name);
+      if (!variable)
+        return std::nullopt;
+      *variable = *value;
+      return value;
+    }
+
+    std::optional<double> lhs = evaluate(node.Lhs);
+    if (!lhs)
+      return std::nullopt;
+    std::optional<double> rhs = evaluate(node.Rhs);
+    if (!rhs)
+      return std::nullopt;
+    return applyBuiltin(node.op, *lhs, *rhs);
+  }
+  case ast::ExprKind::If: {
+    const ast::IfExprAST &node = this->library.getIf(ref);
+    std::optional<double> cond = evaluate(node.cond);
+    if (!cond)
+      return std::nullopt;
+    return evaluate(isTrue(*cond) ? node.then : node.otherwise);
+  }
+  case ast::ExprKind::Let: {
+    const ast::LetExprAST &node = this->library.getLet(ref);
+    size_t scopeSize = this->frame.size();
+    for (const ast::LetBinding &binding : this->library.getBindings(node)) {
+      // The initializer does not see the variable it initializes
+      double value = 0.0;
+      if (binding.init) {
+        std::optional<double> init = evaluate(binding.init);
+        if (!init)
+          return std::nullopt;
+        value = *init;
+      }
+      this->frame.push_back({binding.name, value});
+    }
+
+    std::optional<double> body = evaluate(node.body);
+    this->frame.resize(scopeSize);
+    return body;
+  }
+  case ast::ExprKind::Call: {
+    const ast::FunctionCallExprAST &node = this->library.getCall(ref);
+    llvm::SmallVector<double, 4> args;
+    for (ast::ExprRef arg : this->library.getArgs(node)) {
+      std::optional<double> value = evaluate(arg);
+      if (!value)
+        return std::nullopt;
+      args.push_back(*value);
+    }
+    return call(node.caller, args);
+  }
+  case ast::ExprKind::For: {
+    const ast::ForExprAST &node = this->library.getFor(ref);
+    std::optional<double> start = evaluate(node.start);
+    if (!start)
+      return std::nullopt;
+    std::optional<double> end = evaluate(node.end);
+    if (!end)
+      return std::nullopt;
+    std::optional<double> step = node.step ? evaluate(node.step) : 1.0;
+    if (!step)
+      return std::nullopt;
+    std::optional<double> acc = node.init ? evaluate(node.init) : 0.0;
+    if (!acc)
+      return std::nullopt;
+
+    // The loop variable and the accumulator are only visible to the body
+    size_t scopeSize = this->frame.size();
+    this->frame.push_back({node.var, 0.0});
+    if (node.init)
+      this->frame.push_back({node.accumulator, *acc});
+
+    int64_t count = getTripCount(*start, *end, *step);
+    for (int64_t i = 0; i < count; ++i) {
+      this->frame[scopeSize].second = *start + double(i) * *step;
+      std::optional<double> body = evaluate(node.body);
+      if (!body) {
+        this->frame.resize(scopeSize);
+        return std::nullopt;
+      }
+      if (node.init)
+        this->frame[scopeSize + 1].second = *body;
+    }
+
+    double result = node.init ? this->frame[scopeSize + 1].second : 0.0;
+    this->frame.resize(scopeSize);
+    return result;
+  }
+  case ast::ExprKind::Vector:
+  case ast::ExprKind::Index:
+    llvm_unreachable("vectors are not pure");
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+} // namespace eval
+} // namespace monty
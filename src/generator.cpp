@@ -1,33 +1,115 @@
 #include "../include/generator.hpp"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/VirtualFileSystem.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/SubtargetFeature.h>
 #include <llvm/TargetParser/Triple.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Transforms/Scalar/Reassociate.h>
-#include <llvm/Transforms/Scalar/SimplifyCFG.h>
-#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 #include <memory>
 namespace monty {
 namespace gen {
 
-CodeGenerator::CodeGenerator(std::map<char, int> &_binopPrecedence) noexcept
-    : binopPrecedence(_binopPrecedence) {
+llvm::OptimizationLevel CodeGenOptions::getOptimizationLevel() const noexcept {
+  if (this->sizeLevel == 1)
+    return llvm::OptimizationLevel::Os;
+  if (this->sizeLevel >= 2)
+    return llvm::OptimizationLevel::Oz;
+
+  switch (this->optLevel) {
+  case 0:
+    return llvm::OptimizationLevel::O0;
+  case 1:
+    return llvm::OptimizationLevel::O1;
+  case 2:
+    return llvm::OptimizationLevel::O2;
+  default:
+    return llvm::OptimizationLevel::O3;
+  }
+}
+
+llvm::CodeGenOptLevel CodeGenOptions::getCodeGenOptLevel() const noexcept {
+  switch (this->optLevel) {
+  case 0:
+    return llvm::CodeGenOptLevel::None;
+  case 1:
+    return llvm::CodeGenOptLevel::Less;
+  case 2:
+    return llvm::CodeGenOptLevel::Default;
+  default:
+    return llvm::CodeGenOptLevel::Aggressive;
+  }
+}
+
+std::optional<llvm::PGOOptions> CodeGenOptions::getPGOOptions() const {
+  if (this->profileGenerate)
+    return llvm::PGOOptions(this->profileFile, "", "", "",
+                            llvm::vfs::getRealFileSystem(),
+                            llvm::PGOOptions::IRInstr);
+  if (!this->profileUse.empty())
+    return llvm::PGOOptions(this->profileUse, "", "", "",
+                            llvm::vfs::getRealFileSystem(),
+                            llvm::PGOOptions::IRUse);
+  return std::nullopt;
+}
+
+void resolveHostTarget(CodeGenOptions &options) noexcept {
+  if (options.cpu != "native")
+    return;
+
+  options.cpu = llvm::sys::getHostCPUName().str();
+
+  llvm::SubtargetFeatures hostFeatures;
+  for (const auto &feature : llvm::sys::getHostCPUFeatures())
+    hostFeatures.AddFeature(feature.getKey(), feature.getValue());
+
+  // Explicitly requested features are appended last so they override the
+  // detected ones.
+  std::string features = hostFeatures.getString();
+  if (!options.features.empty())
+    features += "," + options.features;
+  options.features = std::move(features);
+}
+
+std::unique_ptr<llvm::TargetMachine>
+createTargetMachine(const llvm::Triple &triple,
+                    const CodeGenOptions &options) noexcept {
+  std::string registryError;
+  auto target = llvm::TargetRegistry::lookupTarget(triple, registryError);
+  if (!target) {
+    llvm::errs() << registryError << '\n';
+    return nullptr;
+  }
+
+  llvm::TargetOptions opt;
+  return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+      triple, options.cpu, options.features, opt, llvm::Reloc::PIC_,
+      std::nullopt, options.getCodeGenOptLevel()));
+}
+
+CodeGenerator::CodeGenerator(ast::Interner &_symbols,
+                             const CodeGenOptions &_options,
+                             stats::Statistics *_stats) noexcept
+    : symbols(_symbols), options(_options), stats(_stats),
+      constants(_symbols, _options.constEvalSteps) {
   this->llvmContext = std::make_unique<llvm::LLVMContext>();
   this->llvmModule =
       std::make_unique<llvm::Module>("Monty", *this->llvmContext);
 
   this->llvmBuilder = std::make_unique<llvm::IRBuilder<>>(*this->llvmContext);
-  llvm::InitializeAllTargetInfos();
-  llvm::InitializeAllTargets();
-  llvm::InitializeAllTargetMCs();
-  llvm::InitializeAllAsmParsers();
-  llvm::InitializeAllAsmPrinters();
 
   // Create the Triple object first
   llvm::Triple _targetTriple(llvm::sys::getDefaultTargetTriple());
@@ -35,191 +117,443 @@ CodeGenerator::CodeGenerator(std::map<char, int> &_binopPrecedence) noexcept
 
   this->llvmModule->setTargetTriple(this->targetTriplet);
 
-  std::string registryError;
-  auto target =
-      llvm::TargetRegistry::lookupTarget(this->targetTriplet, registryError);
-  if (!target) {
-    llvm::errs() << registryError;
-    std::exit(1);
-  }
-
-  auto cpu = "generic";
-  auto features = "";
-
-  llvm::TargetOptions opt;
-  this->targetMachine = target->createTargetMachine(
-      this->targetTriplet, cpu, features, opt, llvm::Reloc::PIC_);
+  // The error has been printed, valid() reports it to the caller
+  this->targetMachine = createTargetMachine(this->targetTriplet, this->options);
+  if (!this->targetMachine)
+    return;
 
   this->llvmModule->setDataLayout(this->targetMachine->createDataLayout());
+  // Code is always position independent, recorded so that bitcode links with
+  // modules from clang without conflicting flags
+  this->llvmModule->setPICLevel(llvm::PICLevel::BigPIC);
 }
 
 llvm::AllocaInst *
 CodeGenerator::createEntryBlockAlloca(llvm::Function *function,
-                                      llvm::StringRef varName) {
+                                      llvm::StringRef varName,
+                                      llvm::Type *type) {
   llvm::IRBuilder<> TmpB(&function->getEntryBlock(),
                          function->getEntryBlock().begin());
-  return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*this->llvmContext), nullptr,
-                           varName);
-}
-
-/**
-void CodeGenerator::initializeModuleAndPassManager() noexcept {
-// Create context and module
-
-this->llvmModule->setDataLayout(this->targetMachine->createDataLayout());
-this->llvmModule->setTargetTriple(this->targetTriplet);
-
-// Create IRBuilder
-this->llvmBuilder = std::make_unique<llvm::IRBuilder<>>(*this->llvmContext);
-
-// Create pass and analysis managers
-this->fpm = std::make_unique<llvm::FunctionPassManager>();
-this->lam = std::make_unique<llvm::LoopAnalysisManager>();
-this->fam = std::make_unique<llvm::FunctionAnalysisManager>();
-this->cgam = std::make_unique<llvm::CGSCCAnalysisManager>();
-this->mam = std::make_unique<llvm::ModuleAnalysisManager>();
-this->pic = std::make_unique<llvm::PassInstrumentationCallbacks>();
-this->si =
-    std::make_unique<llvm::StandardInstrumentations>(*this->llvmContext,
-                                                     true);
-this->si->registerCallbacks(*this->pic, this->mam.get());
-
-// Add transform passes.
-// Do simple "peephole" optimizations and bit-twiddling optzns.
-this->fpm->addPass(llvm::InstCombinePass());
-// Reassociate expressions.
-this->fpm->addPass(llvm::ReassociatePass());
-// Eliminate Common SubExpressions.
-this->fpm->addPass(llvm::GVNPass());
-// Simplify the control flow graph (deleting unreachable blocks, etc).
-this->fpm->addPass(llvm::SimplifyCFGPass());
-// Promote allocas to registers.
-this->fpm->addPass(llvm::PromotePass());
-// Reassociate expressions.
-this->fpm->addPass(llvm::ReassociatePass());
-
-// Register analysis passes used in these transform passes.
-llvm::PassBuilder pb;
-pb.registerModuleAnalyses(*mam);
-pb.registerFunctionAnalyses(*fam);
-pb.crossRegisterProxies(*this->lam, *this->fam, *this->cgam, *this->mam);
-}
-*/
-
-void CodeGenerator::visit(const ast::NumberExprAST &node) {
-  this->lastValue =
-      llvm::ConstantFP::get(*llvmContext, llvm::APFloat(node.getVal()));
-}
-
-void CodeGenerator::visit(const ast::VariableExprAST &node) {
-  llvm::AllocaInst *v = namedValues[node.getName()];
-
-  if (!v) {
-    this->lastValue = logError("Unkown variable name");
-    return;
+  return TmpB.CreateAlloca(type, nullptr, varName);
+}
+
+llvm::Type *CodeGenerator::getType(ast::Type type) const noexcept {
+  llvm::Type *doubleTy = llvm::Type::getDoubleTy(*this->llvmContext);
+  if (!type.isVector())
+    return doubleTy;
+  return llvm::FixedVectorType::get(doubleTy, type.lanes);
+}
+
+llvm::FunctionType *CodeGenerator::getFunctionType(
+    const ast::FunctionPrototypeAST &node) const noexcept {
+  std::vector<llvm::Type *> params;
+  for (size_t i = 0; i < node.getArgs().size(); ++i)
+    params.push_back(getType(node.getArgType(i)));
+  return llvm::FunctionType::get(getType(node.getReturnType()), params, false);
+}
+
+// The vectorizers run at the levels clang runs them at: from -O2 on and at
+// -Os, only the SLP vectorizer at -Oz
+static llvm::PipelineTuningOptions
+getPipelineTuning(llvm::OptimizationLevel level) noexcept {
+  llvm::PipelineTuningOptions tuning;
+  bool vectorize = level.getSpeedupLevel() > 1;
+  tuning.SLPVectorization = vectorize;
+  tuning.LoopVectorization = vectorize && level.getSizeLevel() < 2;
+  return tuning;
+}
+
+void optimizeModule(llvm::Module &module, llvm::TargetMachine *targetMachine,
+                    llvm::OptimizationLevel level,
+                    std::optional<llvm::PGOOptions> pgo,
+                    llvm::PassInstrumentationCallbacks *callbacks) noexcept {
+  // The analysis managers must be declared in this order so that they are
+  // destroyed correctly.
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  // Register all analyses with the target machine so that target specific
+  // cost models are used.
+  llvm::PassBuilder pb(targetMachine, getPipelineTuning(level), pgo,
+                       callbacks);
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  // -O0 yields a pipeline that only runs the always-inliner and friends.
+  llvm::ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(level);
+  mpm.run(module, mam);
+}
+
+void optimizeWholeProgram(
+    llvm::Module &module, llvm::TargetMachine *targetMachine,
+    const CodeGenOptions &options,
+    llvm::PassInstrumentationCallbacks *callbacks) noexcept {
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  llvm::OptimizationLevel level = options.getOptimizationLevel();
+  llvm::PipelineTuningOptions tuning = getPipelineTuning(level);
+  // Helpers that end up identical once specialized are folded into one
+  tuning.MergeFunctions = true;
+
+  llvm::PassBuilder pb(targetMachine, tuning, options.getPGOOptions(),
+                       callbacks);
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  auto mustPreserve = [&options](const llvm::GlobalValue &value) {
+    llvm::StringRef name = value.getName();
+    if (name == "entry" || llvm::is_contained(options.exports, name))
+      return true;
+    auto *function = llvm::dyn_cast<llvm::Function>(&value);
+    return options.exportOperators && function &&
+           function->hasFnAttribute(llvm::Attribute::AlwaysInline);
+  };
+
+  // With every helper local the standard pipeline's IPSCCP, inliner, dead
+  // argument elimination and global DCE apply to all of them. At -O0 only
+  // the functions that are no longer reachable are dropped.
+  llvm::ModulePassManager mpm;
+  mpm.addPass(llvm::InternalizePass(mustPreserve));
+  mpm.addPass(pb.buildPerModuleDefaultPipeline(level));
+  if (level == llvm::OptimizationLevel::O0)
+    mpm.addPass(llvm::GlobalDCEPass());
+  mpm.run(module, mam);
+}
+
+void inlineOperators(llvm::Module &module) noexcept {
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  llvm::PassBuilder pb;
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  // Operators that are no longer referenced are removed by the pass as well
+  llvm::ModulePassManager mpm;
+  mpm.addPass(llvm::AlwaysInlinerPass(/*InsertLifetimeIntrinsics=*/false));
+  mpm.run(module, mam);
+}
+
+llvm::Value *CodeGenerator::emitExpr(ast::ExprRef ref, bool tail) {
+  // Calls evaluated at compile time are replaced by their value
+  if (std::optional<double> value = this->constants.getFolded(ref))
+    return llvm::ConstantFP::get(*this->llvmContext, llvm::APFloat(*value));
+
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+    return emitNumber(this->exprPool->getNumber(ref));
+  case ast::ExprKind::Variable:
+    return emitVariable(this->exprPool->getVariable(ref));
+  case ast::ExprKind::Unary:
+    return emitUnary(this->exprPool->getUnary(ref));
+  case ast::ExprKind::Binary:
+    return emitBinary(this->exprPool->getBinary(ref), tail);
+  case ast::ExprKind::If:
+    return emitIf(this->exprPool->getIf(ref), tail);
+  case ast::ExprKind::Let:
+    return emitLet(this->exprPool->getLet(ref), tail);
+  case ast::ExprKind::Call:
+    return emitCall(this->exprPool->getCall(ref), tail);
+  case ast::ExprKind::Vector:
+    return emitVector(this->exprPool->getVector(ref));
+  case ast::ExprKind::Index:
+    return emitIndex(this->exprPool->getIndex(ref));
+  case ast::ExprKind::For:
+    return emitFor(this->exprPool->getFor(ref));
   }
+  llvm_unreachable("unknown expression kind");
+}
+
+llvm::Value *CodeGenerator::emitNumber(const ast::NumberExprAST &node) {
+  return llvm::ConstantFP::get(*llvmContext, llvm::APFloat(node.val));
+}
 
-  this->lastValue = this->llvmBuilder->CreateLoad(v->getAllocatedType(), v,
-                                                  node.getName().c_str());
+llvm::AllocaInst *
+CodeGenerator::lookupVariable(ast::Symbol name) const noexcept {
+  return name < this->namedValues.size() ? this->namedValues[name] : nullptr;
 }
 
-void CodeGenerator::visit(const ast::BinaryExprAST &node) {
+void CodeGenerator::bindVariable(ast::Symbol name, llvm::AllocaInst *alloca) {
+  if (name >= this->namedValues.size())
+    this->namedValues.resize(this->symbols.size(), nullptr);
+
+  this->scopeStack.push_back({name, this->namedValues[name]});
+  this->namedValues[name] = alloca;
+}
+
+void CodeGenerator::popScope(size_t depth) noexcept {
+  while (this->scopeStack.size() > depth) {
+    auto [name, shadowed] = this->scopeStack.back();
+    this->namedValues[name] = shadowed;
+    this->scopeStack.pop_back();
+  }
+}
+
+llvm::Value *CodeGenerator::emitVariable(const ast::VariableExprAST &node) {
+  llvm::AllocaInst *v = lookupVariable(node.name);
+
+  if (!v)
+    return logError("Unkown variable name");
+
+  return this->llvmBuilder->CreateLoad(v->getAllocatedType(), v,
+                                       this->symbols.getName(node.name));
+}
+
+llvm::Value *CodeGenerator::emitBinary(const ast::BinaryExprAST &node,
+                                       bool tail) {
+  // `x + f(...)` in tail position of f is folded into the accumulator
+  if (tail && this->accumulateOp && node.op == *this->accumulateOp &&
+      isSelfCall(node.Lhs) != isSelfCall(node.Rhs))
+    return emitAccumulation(node);
+
+  llvm::StringRef op = this->symbols.getName(node.op);
+
   // Special case '=', don't emit the LHS as an expression.
-  if (node.getOp() == '=') {
+  if (op == "=") {
     // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    ast::VariableExprAST *LHSE =
-        static_cast<ast::VariableExprAST *>(node.Lhs.get());
-    if (!LHSE) {
-      this->lastValue = logError("destination of '=' must be a variable");
-      return;
-    }
+    if (node.Lhs.getKind() != ast::ExprKind::Variable)
+      return logError("destination of '=' must be a variable");
+    const ast::VariableExprAST &LHSE = this->exprPool->getVariable(node.Lhs);
+
     // Codegen the RHS.
-    node.Rhs->accept(*this);
-    llvm::Value *val = this->lastValue;
-    if (!val) {
-      this->lastValue = nullptr;
-      return;
-    }
+    llvm::Value *val = emitExpr(node.Rhs);
+    if (!val)
+      return nullptr;
 
     // Look up the name.
-    llvm::Value *variable = this->namedValues[LHSE->getName()];
-    if (!variable) {
-      this->lastValue = logError("Unknown variable name");
-      return;
-    }
+    llvm::AllocaInst *variable = lookupVariable(LHSE.name);
+    if (!variable)
+      return logError("Unknown variable name");
+    if (val->getType() != variable->getAllocatedType())
+      return logError("assigned value does not match the variable's type");
 
     this->llvmBuilder->CreateStore(val, variable);
-    this->lastValue = val;
-    return;
+    return val;
   }
 
-  node.Lhs->accept(*this);
-  llvm::Value *L = this->lastValue;
-  node.Rhs->accept(*this);
-  llvm::Value *R = this->lastValue;
-  if (!L || !R) {
-    this->lastValue = nullptr;
-    return;
-  }
+  llvm::Value *L = emitExpr(node.Lhs);
+  llvm::Value *R = emitExpr(node.Rhs);
+  if (!L || !R)
+    return nullptr;
+
+  // Built-in operators apply to every lane of a vector
+  char builtin = op.size() == 1 ? op.front() : 0;
+  if (llvm::StringRef("+-*<").contains(builtin) && !unifyOperands(L, R))
+    return logError("operands are vectors of different widths");
 
-  switch (node.getOp()) {
+  switch (builtin) {
   case '+':
-    this->lastValue = this->llvmBuilder->CreateFAdd(L, R, "addtmp");
-    return;
+    return contractProducts(this->llvmBuilder->CreateFAdd(L, R, "addtmp"));
   case '-':
-    this->lastValue = this->llvmBuilder->CreateFSub(L, R, "subtmp");
-    return;
+    return contractProducts(this->llvmBuilder->CreateFSub(L, R, "subtmp"));
   case '*':
-    this->lastValue = this->llvmBuilder->CreateFMul(L, R, "multmp");
-    return;
+    return this->llvmBuilder->CreateFMul(L, R, "multmp");
   case '<':
     L = this->llvmBuilder->CreateFCmpULT(L, R, "cmptmp");
     // Convert bool 0/1 to double 0.0 or 1.0
-    this->lastValue = this->llvmBuilder->CreateUIToFP(
-        L, llvm::Type::getDoubleTy(*this->llvmContext), "booltmp");
-    return;
+    return this->llvmBuilder->CreateUIToFP(L, R->getType(), "booltmp");
   default:
     break;
   }
 
   // If it wasn't a builtin binary operator, it must be a user defined one. Emit
   // a call to it.
-  llvm::Function *F = getFunction(std::string("binary") + node.getOp());
-  assert(F && "binary operator not found!");
+  llvm::SmallString<16> opName("binary");
+  opName += op;
+  llvm::Function *F = getFunction(this->symbols.intern(opName));
+  if (!F)
+    return logError("Unknown binary operator");
 
   llvm::Value *ops[] = {L, R};
-  this->lastValue = this->llvmBuilder->CreateCall(F, ops, "binop");
+  return emitOperatorCall(F, ops, "binop");
 }
 
-void CodeGenerator::visit(const ast::UnaryExprAST &node) {
-  node.operand->accept(*this);
-  llvm::Value *OperandV = lastValue;
-  if (!OperandV) {
-    lastValue = nullptr;
-    return;
+void CodeGenerator::setFPSemantics(const ast::FunctionPrototypeAST &node) {
+  FPSemantics &semantics = this->fpSemantics;
+  switch (node.getFPMode()) {
+  case ast::FPMode::Default:
+    semantics.flags = this->options.fastMath;
+    semantics.contract = this->options.fpContract;
+    break;
+  case ast::FPMode::Fast:
+    semantics.flags.setFast();
+    semantics.contract = FPContract::Fast;
+    break;
+  case ast::FPMode::Strict:
+    semantics.flags.clear();
+    semantics.contract = FPContract::Off;
+    break;
   }
 
-  llvm::Function *F = getFunction(std::string("unary") + node.getOpcode());
-  if (!F) {
-    lastValue = logError("Unknown unary operator");
-    return;
+  // The backend fuses operations that both carry the contract flag, so the
+  // choice stays local to the function, even after inlining
+  semantics.flags.setAllowContract(semantics.contract == FPContract::Fast);
+  this->llvmBuilder->setFastMathFlags(semantics.flags);
+}
+
+unsigned CodeGenerator::FPSemantics::getKey() const noexcept {
+  return this->flags.allowReassoc() | this->flags.noNaNs() << 1 |
+         this->flags.noInfs() << 2 | this->flags.noSignedZeros() << 3 |
+         this->flags.allowReciprocal() << 4 |
+         this->flags.allowContract() << 5 | this->flags.approxFunc() << 6 |
+         static_cast<unsigned>(this->contract) << 7;
+}
+
+// A product may be fused with the sum or difference it is an operand of
+static void contractOperands(llvm::Instruction *sum) {
+  for (llvm::Value *operand : sum->operands()) {
+    auto *product = llvm::dyn_cast<llvm::Instruction>(operand);
+    if (product && product->getOpcode() == llvm::Instruction::FMul &&
+        product->hasOneUse()) {
+      product->setHasAllowContract(true);
+      sum->setHasAllowContract(true);
+    }
+  }
+}
+
+// With contraction within expressions, products are fused with the sums they
+// are added to directly
+llvm::Value *CodeGenerator::contractProducts(llvm::Value *sum) {
+  auto *inst = llvm::dyn_cast<llvm::Instruction>(sum);
+  if (this->fpSemantics.contract == FPContract::On && inst)
+    contractOperands(inst);
+  return sum;
+}
+
+// Operators are inlined into their users. A use with semantics other than
+// the operator's own calls a local copy of its body with the user's flags.
+llvm::Function *
+CodeGenerator::getOperatorVariant(llvm::Function *F,
+                                  const FPSemantics &semantics) {
+  if (llvm::Function *origin = this->variantOrigins.lookup(F))
+    F = origin;
+  unsigned key = semantics.getKey();
+  auto defined = this->operatorSemantics.find(F);
+  if (defined == this->operatorSemantics.end() ||
+      defined->second.getKey() == key)
+    return F;
+
+  llvm::Function *&variant = this->operatorVariants[{F, key}];
+  if (variant)
+    return variant;
+  llvm::ValueToValueMapTy vmap;
+  variant = llvm::CloneFunction(F, vmap);
+  variant->setName(F->getName() + ".fp" + llvm::Twine(key));
+  variant->setLinkage(llvm::Function::InternalLinkage);
+  this->variantOrigins[variant] = F;
+
+  // The control of counted loops keeps its exact semantics, see emitFor
+  llvm::SmallPtrSet<llvm::Value *, 8> control;
+  for (llvm::Instruction *inst : this->loopControl.lookup(F))
+    control.insert(vmap.lookup(inst));
+  for (llvm::Instruction &inst : llvm::instructions(variant)) {
+    // Operators used by the operator, or by itself, follow the same semantics
+    if (auto *call = llvm::dyn_cast<llvm::CallInst>(&inst))
+      if (llvm::Function *callee = call->getCalledFunction())
+        if (llvm::Function *used = getOperatorVariant(callee, semantics);
+            used != callee)
+          call->setCalledFunction(used);
+    if (llvm::isa<llvm::FPMathOperator>(inst) && !control.count(&inst))
+      inst.copyFastMathFlags(semantics.flags);
   }
 
-  lastValue = this->llvmBuilder->CreateCall(F, OperandV, "unop");
+  if (semantics.contract == FPContract::On)
+    for (llvm::Instruction &inst : llvm::instructions(variant))
+      if ((inst.getOpcode() == llvm::Instruction::FAdd ||
+           inst.getOpcode() == llvm::Instruction::FSub) &&
+          !control.count(&inst))
+        contractOperands(&inst);
+  return variant;
 }
 
-void CodeGenerator::visit(const ast::IfExprAST &node) {
-  // Emit expression for the condition
-  node.cond->accept(*this);
-  llvm::Value *condV = this->lastValue;
+bool CodeGenerator::unifyOperands(llvm::Value *&lhs, llvm::Value *&rhs) {
+  if (lhs->getType() == rhs->getType())
+    return true;
+
+  auto *lhsType = llvm::dyn_cast<llvm::FixedVectorType>(lhs->getType());
+  auto *rhsType = llvm::dyn_cast<llvm::FixedVectorType>(rhs->getType());
+  if (lhsType && rhsType)
+    return false;
+  if (lhsType)
+    rhs = this->llvmBuilder->CreateVectorSplat(lhsType->getNumElements(), rhs,
+                                               "splat");
+  else
+    lhs = this->llvmBuilder->CreateVectorSplat(rhsType->getNumElements(), lhs,
+                                               "splat");
+  return true;
+}
 
-  if (!condV) {
-    this->lastValue = nullptr;
-    return;
+// Operators declared on doubles are applied lane by lane to vectors
+llvm::Value *
+CodeGenerator::emitOperatorCall(llvm::Function *F,
+                                llvm::MutableArrayRef<llvm::Value *> operands,
+                                const char *name) {
+  F = getOperatorVariant(F, this->fpSemantics);
+  llvm::FunctionType *FT = F->getFunctionType();
+  bool matches = true;
+  for (size_t i = 0; i < operands.size(); ++i)
+    matches &= operands[i]->getType() == FT->getParamType(i);
+  if (matches)
+    return this->llvmBuilder->CreateCall(F, operands, name);
+
+  llvm::Type *doubleTy = llvm::Type::getDoubleTy(*this->llvmContext);
+  bool scalar = FT->getReturnType() == doubleTy;
+  for (llvm::Type *param : FT->params())
+    scalar &= param == doubleTy;
+  if (operands.size() == 2 && !unifyOperands(operands[0], operands[1]))
+    return logError("operands are vectors of different widths");
+  auto *type = llvm::dyn_cast<llvm::FixedVectorType>(operands[0]->getType());
+  if (!scalar || !type)
+    return logError("operand types do not match the operator");
+
+  llvm::Value *result = llvm::PoisonValue::get(type);
+  for (unsigned lane = 0; lane < type->getNumElements(); ++lane) {
+    llvm::SmallVector<llvm::Value *, 2> args;
+    for (llvm::Value *operand : operands)
+      args.push_back(this->llvmBuilder->CreateExtractElement(operand, lane));
+    llvm::Value *value = this->llvmBuilder->CreateCall(F, args, name);
+    result = this->llvmBuilder->CreateInsertElement(result, value, lane);
   }
+  return result;
+}
+
+llvm::Value *CodeGenerator::emitUnary(const ast::UnaryExprAST &node) {
+  llvm::Value *OperandV = emitExpr(node.operand);
+  if (!OperandV)
+    return nullptr;
+
+  llvm::SmallString<16> opName("unary");
+  opName += this->symbols.getName(node.opcode);
+  llvm::Function *F = getFunction(this->symbols.intern(opName));
+  if (!F)
+    return logError("Unknown unary operator");
+
+  return emitOperatorCall(F, OperandV, "unop");
+}
+
+llvm::Value *CodeGenerator::emitIf(const ast::IfExprAST &node, bool tail) {
+  // Emit expression for the condition
+  llvm::Value *condV = emitExpr(node.cond);
+  if (!condV)
+    return nullptr;
+  if (condV->getType()->isVectorTy())
+    return logError("condition of 'if' must be a number");
 
   // Compare the value to zero to get a truth value as 1-bit
   condV = this->llvmBuilder->CreateFCmpONE(
@@ -242,54 +576,59 @@ void CodeGenerator::visit(const ast::IfExprAST &node) {
   // Emit then value.
   this->llvmBuilder->SetInsertPoint(thenBB);
 
-  node.then->accept(*this);
-  llvm::Value *thenV = lastValue;
+  llvm::Value *thenV = emitExpr(node.then, tail);
+  if (!thenV)
+    return nullptr;
 
-  if (!thenV) {
-    lastValue = nullptr;
-    return;
-  }
-
-  this->llvmBuilder->CreateBr(mergeBB);
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
+  // A branch that ended in a tail call does not reach the merge block.
   thenBB = this->llvmBuilder->GetInsertBlock();
+  bool thenMerges = !thenBB->getTerminator();
+  if (thenMerges)
+    this->llvmBuilder->CreateBr(mergeBB);
 
   // Emit else block.
   function->insert(function->end(), elseBB);
   this->llvmBuilder->SetInsertPoint(elseBB);
 
-  node.otherwise->accept(*this);
-  llvm::Value *elseV = this->lastValue;
+  llvm::Value *elseV = emitExpr(node.otherwise, tail);
+  if (!elseV)
+    return nullptr;
 
-  if (!elseV) {
-    lastValue = nullptr;
-    return;
-  }
-
-  this->llvmBuilder->CreateBr(mergeBB);
   // codegen of 'Else' can change the current block, update ElseBB for the PHI.
   elseBB = this->llvmBuilder->GetInsertBlock();
+  bool elseMerges = !elseBB->getTerminator();
+  if (elseMerges)
+    this->llvmBuilder->CreateBr(mergeBB);
+
+  if (!thenMerges && !elseMerges) {
+    delete mergeBB;
+    return llvm::PoisonValue::get(function->getReturnType());
+  }
+  if (thenMerges && elseMerges && thenV->getType() != elseV->getType())
+    return logError("branches of 'if' have different types");
 
   // Emit merge block.
   function->insert(function->end(), mergeBB);
   this->llvmBuilder->SetInsertPoint(mergeBB);
   llvm::PHINode *pn = this->llvmBuilder->CreatePHI(
-      llvm::Type::getDoubleTy(*this->llvmContext), 2, "iftmp");
+      (thenMerges ? thenV : elseV)->getType(), 2, "iftmp");
 
-  pn->addIncoming(thenV, thenBB);
-  pn->addIncoming(elseV, elseBB);
-  lastValue = pn;
+  if (thenMerges)
+    pn->addIncoming(thenV, thenBB);
+  if (elseMerges)
+    pn->addIncoming(elseV, elseBB);
+  return pn;
 }
 
-void CodeGenerator::visit(const ast::LetExprAST &node) {
-  std::vector<llvm::AllocaInst *> oldBindings;
+llvm::Value *CodeGenerator::emitLet(const ast::LetExprAST &node, bool tail) {
+  llvm::ArrayRef<ast::LetBinding> bindings = this->exprPool->getBindings(node);
+  size_t scopeDepth = this->scopeStack.size();
 
   llvm::Function *function = this->llvmBuilder->GetInsertBlock()->getParent();
 
   // Register all variables and emit their initializer.
-  for (unsigned i = 0, e = node.varNames.size(); i != e; ++i) {
-    const std::string &varName = node.varNames[i].first;
-    ast::ExprAST *init = node.varNames[i].second.get();
+  for (const ast::LetBinding &binding : bindings) {
 
     // Emit the initializer before adding the variable to scope, this prevents
     // the initializer from referencing the variable itself, and permits stuff
@@ -297,156 +636,670 @@ void CodeGenerator::visit(const ast::LetExprAST &node) {
     //  var a = 1 in
     //    var a = a in ...   # refers to outer 'a'.
     llvm::Value *initVal;
-    if (init) {
-      init->accept(*this);
-      initVal = this->lastValue;
-      if (!initVal) {
-        lastValue = nullptr;
-        return;
-      }
+    if (binding.init) {
+      initVal = emitExpr(binding.init);
+      if (!initVal)
+        return nullptr;
     } else { // If not specified, use 0.0.
       initVal = llvm::ConstantFP::get(*this->llvmContext, llvm::APFloat(0.0));
     }
 
-    llvm::AllocaInst *alloca = createEntryBlockAlloca(function, varName);
+    llvm::AllocaInst *alloca = createEntryBlockAlloca(
+        function, this->symbols.getName(binding.name), initVal->getType());
     this->llvmBuilder->CreateStore(initVal, alloca);
 
-    // Remember the old variable binding so that we can restore the binding when
-    // we unrecurse.
-    oldBindings.push_back(this->namedValues[varName]);
-
-    // Remember this binding.
-    this->namedValues[varName] = alloca;
+    // Remember this binding, the shadowed one is restored when we unrecurse.
+    bindVariable(binding.name, alloca);
   }
 
   // Codegen the body, now that all vars are in scope.
-  node.body->accept(*this);
-  llvm::Value *bodyVal = this->lastValue;
-  if (!bodyVal) {
-    lastValue = nullptr;
-    return;
-  }
+  llvm::Value *bodyVal = emitExpr(node.body, tail);
+  if (!bodyVal)
+    return nullptr;
 
   // Pop all our variables from scope.
-  for (unsigned i = 0, e = node.varNames.size(); i != e; ++i)
-    this->namedValues[node.varNames[i].first] = oldBindings[i];
+  popScope(scopeDepth);
 
   // Return the body computation.
-  lastValue = bodyVal;
+  return bodyVal;
 }
 
-void CodeGenerator::visit(const ast::FunctionCallExprAST &node) {
-  llvm::Function *calleeF = getFunction(node.getCaller());
-
+llvm::Value *CodeGenerator::emitCall(const ast::FunctionCallExprAST &node,
+                                     bool tail) {
+  llvm::Function *calleeF = getFunction(node.caller);
   if (!calleeF) {
-    this->lastValue = logError("Unknown function referenced");
-    return;
+    llvm::StringRef name = this->symbols.getName(node.caller);
+    if (name == "hadd" || name == "hmul" || name == "hmin" || name == "hmax")
+      return emitReduction(name, node);
+    return logError("Unknown function referenced");
   }
 
   // If argument mismatch error.
-  if (calleeF->arg_size() != node.args.size()) {
-    this->lastValue = logError("Incorrect # arguments passed");
-    return;
-  }
+  llvm::ArrayRef<ast::ExprRef> args = this->exprPool->getArgs(node);
+  if (calleeF->arg_size() != args.size())
+    return logError("Incorrect # arguments passed");
 
   std::vector<llvm::Value *> argsV;
-  for (unsigned i = 0, e = node.args.size(); i != e; ++i) {
-    node.args[i]->accept(*this);
-    argsV.push_back(this->lastValue);
+  for (ast::ExprRef arg : args) {
+    argsV.push_back(emitExpr(arg));
+    if (!argsV.back())
+      return nullptr;
+    if (argsV.back()->getType() != calleeF->getArg(argsV.size() - 1)->getType())
+      return logError("Argument type does not match the prototype");
+  }
 
-    if (!argsV.back()) {
-      this->lastValue = nullptr;
-      return;
+  // Calls to the function itself in tail position become jumps
+  if (tail && node.caller == this->currentName) {
+    assert(this->recurseBB && "tail recursion was not found in advance");
+    return emitRecursion(argsV, nullptr);
+  }
+
+  llvm::CallInst *call =
+      this->llvmBuilder->CreateCall(calleeF, argsV, "calltmp");
+  return tail ? emitTailCall(call) : call;
+}
+
+// Horizontal operations over the lanes of a vector, used unless a function of
+// the same name is declared
+llvm::Value *
+CodeGenerator::emitReduction(llvm::StringRef name,
+                             const ast::FunctionCallExprAST &node) {
+  llvm::ArrayRef<ast::ExprRef> args = this->exprPool->getArgs(node);
+  if (args.size() != 1)
+    return logError("Incorrect # arguments passed");
+
+  llvm::Value *vector = emitExpr(args[0]);
+  if (!vector)
+    return nullptr;
+  if (!vector->getType()->isVectorTy())
+    return logError("horizontal operations expect a vector");
+
+  // The sums are ordered, lane 0 first, like the equivalent scalar code
+  llvm::Type *doubleTy = llvm::Type::getDoubleTy(*this->llvmContext);
+  if (name == "hadd")
+    return this->llvmBuilder->CreateFAddReduce(
+        llvm::ConstantFP::get(doubleTy, -0.0), vector);
+  if (name == "hmul")
+    return this->llvmBuilder->CreateFMulReduce(
+        llvm::ConstantFP::get(doubleTy, 1.0), vector);
+  if (name == "hmin")
+    return this->llvmBuilder->CreateFPMinReduce(vector);
+  return this->llvmBuilder->CreateFPMaxReduce(vector);
+}
+
+llvm::Value *CodeGenerator::emitVector(const ast::VectorExprAST &node) {
+  llvm::ArrayRef<ast::ExprRef> elements = this->exprPool->getElements(node);
+  auto *type = llvm::FixedVectorType::get(
+      llvm::Type::getDoubleTy(*this->llvmContext), elements.size());
+
+  // Constant elements are folded into a constant vector by the builder
+  llvm::Value *vector = llvm::PoisonValue::get(type);
+  for (size_t i = 0; i < elements.size(); ++i) {
+    llvm::Value *element = emitExpr(elements[i]);
+    if (!element)
+      return nullptr;
+    if (element->getType()->isVectorTy())
+      return logError("vector elements must be numbers");
+    vector = this->llvmBuilder->CreateInsertElement(vector, element, i, "vec");
+  }
+  return vector;
+}
+
+llvm::Value *CodeGenerator::emitIndex(const ast::IndexExprAST &node) {
+  llvm::Value *vector = emitExpr(node.vector);
+  if (!vector)
+    return nullptr;
+
+  auto *type = llvm::dyn_cast<llvm::FixedVectorType>(vector->getType());
+  if (!type)
+    return logError("only vectors have lanes");
+  if (node.lane >= type->getNumElements())
+    return logError("lane out of range");
+  return this->llvmBuilder->CreateExtractElement(vector, uint64_t(node.lane),
+                                                 "lane");
+}
+
+// Loops are emitted in the canonical form the loop passes expect: an integer
+// index counts from 0 to a trip count computed in the preheader, the guard
+// skips empty loops and the latch tests for the exit. The loop variable is
+// computed from the index, so no rounding error builds up in it and the
+// vectorizer sees a single integer induction variable.
+llvm::Value *CodeGenerator::emitFor(const ast::ForExprAST &node) {
+  llvm::IRBuilder<> &builder = *this->llvmBuilder;
+  llvm::Type *doubleTy = builder.getDoubleTy();
+  llvm::Type *indexTy = builder.getInt64Ty();
+
+  llvm::Value *startV = emitExpr(node.start);
+  if (!startV)
+    return nullptr;
+  llvm::Value *endV = emitExpr(node.end);
+  if (!endV)
+    return nullptr;
+  llvm::Value *stepV = node.step ? emitExpr(node.step)
+                                 : llvm::ConstantFP::get(doubleTy, 1.0);
+  if (!stepV)
+    return nullptr;
+  if (startV->getType() != doubleTy || endV->getType() != doubleTy ||
+      stepV->getType() != doubleTy)
+    return logError("bounds and step of 'for' must be numbers");
+  auto *constantStep = llvm::dyn_cast<llvm::ConstantFP>(stepV);
+  if (constantStep && constantStep->isZero())
+    return logError("step of 'for' must not be 0");
+
+  // The initial value does not see the loop's variables
+  llvm::Value *initV = nullptr;
+  if (node.init && !(initV = emitExpr(node.init)))
+    return nullptr;
+
+  // Fast-math flags do not apply to the control of the loop, its trip count
+  // and variable. Operators record it for their copies with other flags.
+  llvm::Function *function = builder.GetInsertBlock()->getParent();
+  llvm::FastMathFlags flags = builder.getFastMathFlags();
+  builder.clearFastMathFlags();
+  auto control = [&](llvm::Value *value) {
+    auto *inst = llvm::dyn_cast<llvm::Instruction>(value);
+    if (inst && this->currentIsOperator)
+      this->loopControl[function].push_back(inst);
+    return value;
+  };
+
+  // ceil((end - start) / step) iterations, none if that is not finite, e.g.
+  // for a step of 0. Finite counts beyond int64_t saturate, so the loop
+  // always terminates.
+  llvm::Value *steps = control(builder.CreateFSub(endV, startV, "span"));
+  steps = control(builder.CreateFDiv(steps, stepV, "steps"));
+  steps = control(builder.CreateUnaryIntrinsic(llvm::Intrinsic::ceil, steps));
+  llvm::Value *finite = control(builder.CreateFCmpOLT(
+      steps, llvm::ConstantFP::getInfinity(doubleTy), "finite"));
+  llvm::Value *count = builder.CreateSelect(
+      finite,
+      builder.CreateIntrinsic(llvm::Intrinsic::fptosi_sat,
+                              {indexTy, doubleTy}, {steps}),
+      builder.getInt64(0), "tripcount");
+
+  llvm::AllocaInst *index = createEntryBlockAlloca(function, "index", indexTy);
+  llvm::AllocaInst *var = createEntryBlockAlloca(
+      function, this->symbols.getName(node.var), doubleTy);
+  llvm::AllocaInst *acc = nullptr;
+  builder.CreateStore(builder.getInt64(0), index);
+  if (initV) {
+    acc = createEntryBlockAlloca(
+        function, this->symbols.getName(node.accumulator), initV->getType());
+    builder.CreateStore(initV, acc);
+  }
+
+  llvm::BasicBlock *loopBB =
+      llvm::BasicBlock::Create(*this->llvmContext, "loop", function);
+  llvm::BasicBlock *afterBB =
+      llvm::BasicBlock::Create(*this->llvmContext, "afterloop");
+  llvm::Value *enter =
+      builder.CreateICmpSGT(count, builder.getInt64(0), "loopguard");
+  builder.CreateCondBr(enter, loopBB, afterBB);
+
+  builder.SetInsertPoint(loopBB);
+  llvm::Value *indexV = builder.CreateLoad(indexTy, index, "index");
+  llvm::Value *offset = control(builder.CreateFMul(
+      builder.CreateSIToFP(indexV, doubleTy), stepV, "offset"));
+  builder.CreateStore(
+      control(builder.CreateFAdd(startV, offset, "loopvar")), var);
+  builder.setFastMathFlags(flags);
+
+  size_t scopeDepth = this->scopeStack.size();
+  bindVariable(node.var, var);
+  if (acc)
+    bindVariable(node.accumulator, acc);
+  llvm::Value *bodyV = emitExpr(node.body);
+  if (!bodyV)
+    return nullptr;
+  popScope(scopeDepth);
+
+  if (acc) {
+    if (bodyV->getType() != acc->getAllocatedType())
+      return logError("body of 'for' does not match the accumulator's type");
+    builder.CreateStore(bodyV, acc);
+  }
+
+  llvm::Value *nextV = builder.CreateAdd(indexV, builder.getInt64(1),
+                                         "nextindex", /*HasNUW=*/true,
+                                         /*HasNSW=*/true);
+  builder.CreateStore(nextV, index);
+  llvm::Value *more = builder.CreateICmpSLT(nextV, count, "loopcond");
+  llvm::BranchInst *latch = builder.CreateCondBr(more, loopBB, afterBB);
+
+  // Counted loops always terminate, so they may be deleted when their result
+  // is unused
+  llvm::LLVMContext &context = *this->llvmContext;
+  llvm::Metadata *mustProgress = llvm::MDNode::get(
+      context, llvm::MDString::get(context, "llvm.loop.mustprogress"));
+  llvm::MDNode *loopID =
+      llvm::MDNode::getDistinct(context, {nullptr, mustProgress});
+  loopID->replaceOperandWith(0, loopID);
+  latch->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+
+  function->insert(function->end(), afterBB);
+  builder.SetInsertPoint(afterBB);
+  if (!acc)
+    return llvm::ConstantFP::get(doubleTy, 0.0);
+  return builder.CreateLoad(acc->getAllocatedType(), acc, "loopresult");
+}
+
+llvm::Value *CodeGenerator::emitTailCall(llvm::CallInst *call) {
+  // The call reuses the caller's frame for certain if the prototypes match
+  // and its result is returned as is. Operators are inlined into other
+  // functions and only get a hint.
+  llvm::Function *function = this->llvmBuilder->GetInsertBlock()->getParent();
+  if (this->accumulator || this->currentIsOperator ||
+      call->getFunctionType() != function->getFunctionType()) {
+    call->setTailCall();
+    return call;
+  }
+
+  call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+  this->llvmBuilder->CreateRet(call);
+  return call;
+}
+
+llvm::Value *CodeGenerator::emitAccumulation(const ast::BinaryExprAST &node) {
+  // The operand is evaluated in source order if it is on the left, on the
+  // right it does not call any function and its order does not matter.
+  bool callOnLeft = isSelfCall(node.Lhs);
+  const ast::FunctionCallExprAST &call =
+      this->exprPool->getCall(callOnLeft ? node.Lhs : node.Rhs);
+  ast::ExprRef operand = callOnLeft ? node.Rhs : node.Lhs;
+
+  llvm::Value *operandV = nullptr;
+  if (!callOnLeft && !(operandV = emitExpr(operand)))
+    return nullptr;
+
+  llvm::SmallVector<llvm::Value *, 4> argsV;
+  for (ast::ExprRef arg : this->exprPool->getArgs(call)) {
+    argsV.push_back(emitExpr(arg));
+    if (!argsV.back())
+      return nullptr;
+  }
+
+  if (callOnLeft && !(operandV = emitExpr(operand)))
+    return nullptr;
+
+  return emitRecursion(argsV, operandV);
+}
+
+llvm::Value *CodeGenerator::emitRecursion(llvm::ArrayRef<llvm::Value *> args,
+                                          llvm::Value *accumulated) {
+  if (args.size() != this->params.size())
+    return logError("Incorrect # arguments passed");
+  for (size_t i = 0; i < args.size(); ++i)
+    if (args[i]->getType() != this->params[i]->getAllocatedType())
+      return logError("Argument type does not match the prototype");
+
+  if (accumulated) {
+    llvm::Type *type = this->accumulator->getAllocatedType();
+    if (accumulated->getType() != type) {
+      // A double scales or offsets every lane of a vector result
+      auto *vectorType = llvm::dyn_cast<llvm::FixedVectorType>(type);
+      if (!vectorType || accumulated->getType()->isVectorTy())
+        return logError("operand does not match the function's result type");
+      accumulated = this->llvmBuilder->CreateVectorSplat(
+          vectorType->getNumElements(), accumulated, "splat");
     }
+    llvm::Value *acc =
+        this->llvmBuilder->CreateLoad(type, this->accumulator, "acc");
+    this->llvmBuilder->CreateStore(combine(acc, accumulated),
+                                   this->accumulator);
   }
 
-  this->lastValue = this->llvmBuilder->CreateCall(calleeF, argsV, "calltmp");
+  // All arguments are evaluated before the parameters are overwritten
+  for (size_t i = 0; i < args.size(); ++i)
+    this->llvmBuilder->CreateStore(args[i], this->params[i]);
+  this->llvmBuilder->CreateBr(this->recurseBB);
+
+  llvm::Function *function = this->recurseBB->getParent();
+  return llvm::PoisonValue::get(function->getReturnType());
 }
 
-void CodeGenerator::visit(const ast::FunctionPrototypeAST &node) {
-  std::vector<llvm::Type *> doubles(
-      node.getArgs().size(), llvm::Type::getDoubleTy(*this->llvmContext));
+llvm::Value *CodeGenerator::combine(llvm::Value *accumulated,
+                                    llvm::Value *value) {
+  if (*this->accumulateOp == this->symbols.intern("*"))
+    return this->llvmBuilder->CreateFMul(accumulated, value, "accmul");
+  return contractProducts(
+      this->llvmBuilder->CreateFAdd(accumulated, value, "accadd"));
+}
 
-  llvm::FunctionType *FT = llvm::FunctionType::get(
-      llvm::Type::getDoubleTy(*this->llvmContext), doubles, false);
+bool CodeGenerator::isSelfCall(ast::ExprRef ref) const noexcept {
+  return ref.getKind() == ast::ExprKind::Call &&
+         this->exprPool->getCall(ref).caller == this->currentName;
+}
 
-  llvm::Function *F =
-      llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
-                             node.getName(), this->llvmModule.get());
+bool CodeGenerator::containsCall(ast::ExprRef ref) const noexcept {
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+  case ast::ExprKind::Variable:
+    return false;
+  case ast::ExprKind::Unary: // user-defined operators are calls
+  case ast::ExprKind::Call:
+    return true;
+  case ast::ExprKind::Binary: {
+    const ast::BinaryExprAST &node = this->exprPool->getBinary(ref);
+    llvm::StringRef op = this->symbols.getName(node.op);
+    if (op.size() != 1 || !llvm::StringRef("=+-*<").contains(op.front()))
+      return true;
+    return containsCall(node.Lhs) || containsCall(node.Rhs);
+  }
+  case ast::ExprKind::If: {
+    const ast::IfExprAST &node = this->exprPool->getIf(ref);
+    return containsCall(node.cond) || containsCall(node.then) ||
+           containsCall(node.otherwise);
+  }
+  case ast::ExprKind::Let: {
+    const ast::LetExprAST &node = this->exprPool->getLet(ref);
+    for (const ast::LetBinding &binding : this->exprPool->getBindings(node))
+      if (binding.init && containsCall(binding.init))
+        return true;
+    return containsCall(node.body);
+  }
+  case ast::ExprKind::Vector:
+    for (ast::ExprRef element :
+         this->exprPool->getElements(this->exprPool->getVector(ref)))
+      if (containsCall(element))
+        return true;
+    return false;
+  case ast::ExprKind::Index:
+    return containsCall(this->exprPool->getIndex(ref).vector);
+  case ast::ExprKind::For: {
+    const ast::ForExprAST &node = this->exprPool->getFor(ref);
+    for (ast::ExprRef child :
+         {node.start, node.end, node.step, node.init, node.body})
+      if (child && containsCall(child))
+        return true;
+    return false;
+  }
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+// Find the calls of the function being emitted to itself. `tail` is set for
+// expressions in tail position, `accumulate` allows `x + f(...)` and
+// `x * f(...)` there.
+void CodeGenerator::analyzeRecursion(ast::ExprRef ref, bool tail,
+                                     bool accumulate,
+                                     RecursionInfo &info) const noexcept {
+  auto problem = [&](const char *message) {
+    if (!info.problem)
+      info.problem = message;
+  };
+
+  switch (ref.getKind()) {
+  case ast::ExprKind::Number:
+  case ast::ExprKind::Variable:
+    return;
+  case ast::ExprKind::Unary:
+    analyzeRecursion(this->exprPool->getUnary(ref).operand, false, accumulate,
+                     info);
+    return;
+  case ast::ExprKind::Binary: {
+    const ast::BinaryExprAST &node = this->exprPool->getBinary(ref);
+    llvm::StringRef op = this->symbols.getName(node.op);
+    bool callOnLeft = isSelfCall(node.Lhs);
+    if (tail && accumulate && (op == "+" || op == "*") &&
+        callOnLeft != isSelfCall(node.Rhs)) {
+      if (info.accumulateOp && *info.accumulateOp != node.op)
+        problem("its recursive calls are combined with different operators");
+      info.accumulateOp = node.op;
+
+      const ast::FunctionCallExprAST &call =
+          this->exprPool->getCall(callOnLeft ? node.Lhs : node.Rhs);
+      for (ast::ExprRef arg : this->exprPool->getArgs(call))
+        analyzeRecursion(arg, false, accumulate, info);
+
+      // Moving calls in the operand before the recursive call would reorder
+      // their side effects
+      ast::ExprRef operand = callOnLeft ? node.Rhs : node.Lhs;
+      if (callOnLeft && containsCall(operand))
+        problem("a call is made after one of its recursive calls returns");
+      analyzeRecursion(operand, false, accumulate, info);
+      return;
+    }
+
+    analyzeRecursion(node.Lhs, false, accumulate, info);
+    analyzeRecursion(node.Rhs, false, accumulate, info);
+    return;
+  }
+  case ast::ExprKind::If: {
+    const ast::IfExprAST &node = this->exprPool->getIf(ref);
+    analyzeRecursion(node.cond, false, accumulate, info);
+    analyzeRecursion(node.then, tail, accumulate, info);
+    analyzeRecursion(node.otherwise, tail, accumulate, info);
+    return;
+  }
+  case ast::ExprKind::Let: {
+    const ast::LetExprAST &node = this->exprPool->getLet(ref);
+    for (const ast::LetBinding &binding : this->exprPool->getBindings(node))
+      if (binding.init)
+        analyzeRecursion(binding.init, false, accumulate, info);
+    analyzeRecursion(node.body, tail, accumulate, info);
+    return;
+  }
+  case ast::ExprKind::Call: {
+    const ast::FunctionCallExprAST &node = this->exprPool->getCall(ref);
+    if (node.caller == this->currentName) {
+      if (tail)
+        info.tailCalls = true;
+      else
+        problem("one of its recursive calls is not in tail position");
+    }
+    for (ast::ExprRef arg : this->exprPool->getArgs(node))
+      analyzeRecursion(arg, false, accumulate, info);
+    return;
+  }
+  case ast::ExprKind::Vector:
+    for (ast::ExprRef element :
+         this->exprPool->getElements(this->exprPool->getVector(ref)))
+      analyzeRecursion(element, false, accumulate, info);
+    return;
+  case ast::ExprKind::Index:
+    analyzeRecursion(this->exprPool->getIndex(ref).vector, false, accumulate,
+                     info);
+    return;
+  case ast::ExprKind::For: {
+    // The body is repeated, none of it is in tail position
+    const ast::ForExprAST &node = this->exprPool->getFor(ref);
+    for (ast::ExprRef child :
+         {node.start, node.end, node.step, node.init, node.body})
+      if (child)
+        analyzeRecursion(child, false, accumulate, info);
+    return;
+  }
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+llvm::Function *
+CodeGenerator::emitPrototype(const ast::FunctionPrototypeAST &node) {
+  llvm::FunctionType *FT = getFunctionType(node);
+
+  llvm::Function *F = llvm::Function::Create(
+      FT, llvm::Function::ExternalLinkage,
+      this->symbols.getName(node.getName()), this->llvmModule.get());
 
   unsigned idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(node.getArgs()[idx++]);
+    Arg.setName(this->symbols.getName(node.getArgs()[idx++]));
 
-  this->lastFunctionValue = F;
+  this->functions[node.getName()] = F;
+  return F;
 }
 
-void CodeGenerator::visit(ast::FunctionAST &node) {
+llvm::Function *CodeGenerator::emitFunction(ast::FunctionAST &node,
+                                            const ast::ExprPool &pool) {
+  stats::PhaseTime start;
+  if (this->stats)
+    start = stats::PhaseTime::now();
+  stats::PhaseTimer irgenTimer(this->stats, stats::Phase::IRGen);
+
   auto &P = *node.prototype;
   this->functionPrototypes[node.prototype->getName()] =
       std::move(node.prototype);
 
   llvm::Function *function = getFunction(P.getName());
-  if (!function) {
-    lastFunctionValue = nullptr;
-    return;
+  if (!function)
+    return nullptr;
+
+  if (function->arg_size() != P.getArgs().size()) {
+    logError("Definition does not match the declared number of arguments");
+    return nullptr;
+  }
+  if (function->getFunctionType() != getFunctionType(P)) {
+    logError("Definition does not match the declared types");
+    return nullptr;
   }
 
-  // If this is an operator, install it.
-  if (P.isBinaryOp())
-    binopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+  // Record the selected target so that the optimizer and later link steps see
+  // the same CPU and features as the backend.
+  function->addFnAttr("target-cpu", this->options.cpu);
+  if (!this->options.features.empty())
+    function->addFnAttr("target-features", this->options.features);
+  // Monty has no exceptions, C++ callers need no landing pads after a call
+  function->addFnAttr(llvm::Attribute::NoUnwind);
 
   // Create a new basic block to start insertion into.
   llvm::BasicBlock *BB =
       llvm::BasicBlock::Create(*this->llvmContext, "entry", function);
   this->llvmBuilder->SetInsertPoint(BB);
 
-  // Record the function arguments in the NamedValues map.
-  this->namedValues.clear();
+  // Record the function arguments in the symbol table. Bindings left behind
+  // by a function that failed to generate are dropped first.
+  popScope(0);
+  this->params.clear();
   for (auto &arg : function->args()) {
-    llvm::AllocaInst *alloca = createEntryBlockAlloca(function, arg.getName());
+    llvm::AllocaInst *alloca =
+        createEntryBlockAlloca(function, arg.getName(), arg.getType());
 
     this->llvmBuilder->CreateStore(&arg, alloca);
 
-    this->namedValues[std::string(arg.getName())] = alloca;
+    bindVariable(P.getArgs()[arg.getArgNo()], alloca);
+    this->params.push_back(alloca);
+  }
+
+  setFPSemantics(P);
+  irgenTimer.stop();
+
+  unsigned foldedCalls;
+  {
+    stats::PhaseTimer foldTimer(this->stats, stats::Phase::Fold);
+    foldedCalls = this->constants.fold(pool, node.body);
+  }
+  if (this->stats)
+    this->stats->foldedCalls += foldedCalls;
+  stats::PhaseTimer bodyTimer(this->stats, stats::Phase::IRGen);
+
+  this->exprPool = &pool;
+  this->currentName = P.getName();
+  this->currentIsOperator = P.isUnaryOp() || P.isBinaryOp();
+
+  // Calls to itself in tail position jump back to the start of the body, so
+  // that recursion does not grow the stack at any optimization level.
+  RecursionInfo recursion;
+  analyzeRecursion(node.body, true, P.isTailRecursive(), recursion);
+  llvm::Value *retVal = nullptr;
+  if (P.isTailRecursive() && recursion.problem) {
+    std::string message = "Function '" +
+                          this->symbols.getName(P.getName()).str() +
+                          "' is marked tailrec, but " + recursion.problem;
+    logError(message.c_str());
+  } else {
+    if (recursion.accumulateOp) {
+      this->accumulateOp = recursion.accumulateOp;
+      llvm::Type *type = function->getReturnType();
+      this->accumulator = createEntryBlockAlloca(function, "accumulator", type);
+      double identity = this->symbols.getName(*this->accumulateOp) == "*"
+                            ? 1.0
+                            : -0.0;
+      this->llvmBuilder->CreateStore(llvm::ConstantFP::get(type, identity),
+                                     this->accumulator);
+    }
+    if (recursion.tailCalls || recursion.accumulateOp) {
+      this->recurseBB = llvm::BasicBlock::Create(*this->llvmContext,
+                                                 "tailrecurse", function);
+      this->llvmBuilder->CreateBr(this->recurseBB);
+      this->llvmBuilder->SetInsertPoint(this->recurseBB);
+    }
+    retVal = emitExpr(node.body, true);
   }
 
-  node.body->accept(*this);
-  if (llvm::Value *retVal = this->lastValue) {
-    // Finish off the function.
+  // Finish off the function, unless every path ended in a tail call
+  if (retVal && !this->llvmBuilder->GetInsertBlock()->getTerminator() &&
+      retVal->getType() != function->getReturnType()) {
+    logError("Function body does not match its result type");
+    retVal = nullptr;
+  }
+  if (retVal && !this->llvmBuilder->GetInsertBlock()->getTerminator()) {
+    if (this->accumulator) {
+      llvm::Value *acc = this->llvmBuilder->CreateLoad(
+          this->accumulator->getAllocatedType(), this->accumulator, "acc");
+      retVal = combine(acc, retVal);
+    }
     this->llvmBuilder->CreateRet(retVal);
+  }
+
+  this->exprPool = nullptr;
+  this->params.clear();
+  this->recurseBB = nullptr;
+  this->accumulator = nullptr;
+  this->accumulateOp.reset();
+
+  if (retVal) {
+    bodyTimer.stop();
 
     // Validate the generated code, checking for consistency.
-    llvm::verifyFunction(*function);
+    {
+      stats::PhaseTimer verifyTimer(this->stats, stats::Phase::Verify);
+      llvm::verifyFunction(*function);
+    }
 
-    // this->fpm->run(*function, *this->fam);
+    // Top-level expressions are never called from other modules, keep them
+    // local so that objects compiled from several source files link together.
+    if (this->symbols.getName(P.getName()) == "__anon_expr")
+      function->setLinkage(llvm::Function::InternalLinkage);
+    else
+      this->constants.define(P, pool, node.body);
+
+    // Operators are inlined at every use. They stay local to the module, like
+    // their definitions stay local to the source file, unless exported.
+    if (P.isUnaryOp() || P.isBinaryOp()) {
+      function->addFnAttr(llvm::Attribute::AlwaysInline);
+      if (!this->options.exportOperators)
+        function->setLinkage(llvm::Function::InternalLinkage);
+      this->operatorSemantics[function] = this->fpSemantics;
+    }
 
-    this->lastFunctionValue = function;
-    return;
+    if (this->stats)
+      this->stats->addFunctionTime(function->getName(),
+                                   (stats::PhaseTime::now() - start).wall);
+    return function;
   }
 
   // Error reading body, remove function.
+  this->functions.erase(P.getName());
+  this->loopControl.erase(function);
   function->eraseFromParent();
-  this->lastFunctionValue = nullptr;
+  return nullptr;
 }
 
-llvm::Value *CodeGenerator::logError(const char *str) const noexcept {
+llvm::Value *CodeGenerator::logError(const char *str) noexcept {
+  ++this->errors;
   fprintf(stderr, "Error: %s\n", str);
   return nullptr;
 }
 
-llvm::Function *CodeGenerator::getFunction(std::string name) noexcept {
+llvm::Function *CodeGenerator::getFunction(ast::Symbol name) noexcept {
   // check if function has already bin added to the current module
-  if (auto *f = this->llvmModule->getFunction(name)) {
+  if (auto *f = this->functions.lookup(name))
     return f;
-  }
 
   // check if the declaration can be generated from an existing prototype
   auto fi = this->functionPrototypes.find(name);
-  if (fi != this->functionPrototypes.end()) {
-    fi->second->accept(*this);
-    return lastFunctionValue;
-  }
+  if (fi != this->functionPrototypes.end())
+    return emitPrototype(*fi->second);
 
   return nullptr;
 }
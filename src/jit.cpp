@@ -0,0 +1,83 @@
+#include "../include/jit.hpp"
+#include "../cpp-runtime/runtime.hpp"
+#include <llvm/ExecutionEngine/Orc/AbsoluteSymbols.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/TargetParser/SubtargetFeature.h>
+
+namespace monty {
+namespace jit {
+
+int run(std::vector<llvm::orc::ThreadSafeModule> modules,
+        const gen::CodeGenOptions &options) {
+  llvm::ExitOnError exitOnErr("montyc: ");
+
+  // Code runs on the host, but for the CPU and features selected on the
+  // command line like ahead-of-time builds, e.g. -march=native. The optimizer
+  // uses the same target machine for its cost model.
+  auto targetBuilder =
+      exitOnErr(llvm::orc::JITTargetMachineBuilder::detectHost());
+  targetBuilder.setCPU(options.cpu);
+  targetBuilder.getFeatures() = llvm::SubtargetFeatures(options.features);
+  targetBuilder.setCodeGenOptLevel(options.getCodeGenOptLevel());
+  std::unique_ptr<llvm::TargetMachine> targetMachine =
+      exitOnErr(targetBuilder.createTargetMachine());
+
+  auto jit = exitOnErr(llvm::orc::LLLazyJITBuilder()
+                           .setJITTargetMachineBuilder(targetBuilder)
+                           .create());
+  auto &mainJD = jit->getMainJITDylib();
+
+  // The runtime builtins are linked into montyc itself, so `using` externs
+  // for them resolve without loading the runtime library.
+  llvm::orc::SymbolMap builtins;
+  builtins[jit->mangleAndIntern("putchard")] = {
+      llvm::orc::ExecutorAddr::fromPtr(&putchard),
+      llvm::JITSymbolFlags::Exported};
+  builtins[jit->mangleAndIntern("printd")] = {
+      llvm::orc::ExecutorAddr::fromPtr(&printd),
+      llvm::JITSymbolFlags::Exported};
+  exitOnErr(mainJD.define(llvm::orc::absoluteSymbols(std::move(builtins))));
+
+  // Everything else declared with `using` is looked up in the process, e.g.
+  // functions from libm.
+  mainJD.addGenerator(
+      exitOnErr(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          jit->getDataLayout().getGlobalPrefix())));
+
+  // Each function is materialized in its own partition on first call; run
+  // the optimization pipeline on that partition just before it is compiled.
+  llvm::OptimizationLevel level = options.getOptimizationLevel();
+  std::optional<llvm::PGOOptions> pgo = options.getPGOOptions();
+  llvm::TargetMachine *machine = targetMachine.get();
+  jit->getIRTransformLayer().setTransform(
+      [level, pgo, machine](llvm::orc::ThreadSafeModule tsm,
+                            const llvm::orc::MaterializationResponsibility &)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        tsm.withModuleDo([&](llvm::Module &module) {
+          gen::optimizeModule(module, machine, level, pgo);
+        });
+        return tsm;
+      });
+
+  for (llvm::orc::ThreadSafeModule &tsm : modules) {
+    tsm.withModuleDo([&](llvm::Module &module) {
+      module.setDataLayout(jit->getDataLayout());
+      module.setTargetTriple(jit->getTargetTriple());
+      // Partitions only hold a single function, inline operators beforehand
+      gen::inlineOperators(module);
+    });
+    exitOnErr(jit->addLazyIRModule(std::move(tsm)));
+  }
+
+  auto entrySymbol = exitOnErr(jit->lookup("entry"));
+  auto *entry = entrySymbol.toPtr<double (*)()>();
+  entry();
+
+  // Like a linked executable, whatever entry() returns
+  return 0;
+}
+
+} // namespace jit
+} // namespace monty
@@ -1,19 +1,70 @@
+#include "../include/cache.hpp"
 #include "../include/cli.hpp"
 #include "../include/driver.hpp"
+#include "../include/emitter.hpp"
 #include "../include/generator.hpp"
+#include "../include/jit.hpp"
 #include "../include/parser.hpp"
-#include "llvm/IR/LegacyPassManager.h"
-#include <fstream>
-#include <iostream>
-#include <istream>
-#include <llvm/MC/TargetRegistry.h>
-#include <llvm/Support/CodeGen.h>
+#include "../include/stats.hpp"
+#include <atomic>
+#include <cstdint>
+#include <llvm/ADT/Statistic.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
 #include <llvm/Support/raw_ostream.h>
-#include <llvm/Target/TargetMachine.h>
-#include <llvm/Target/TargetOptions.h>
-#include <llvm/TargetParser/Host.h>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// Number of functions listed in the time report and statistics file
+static constexpr unsigned slowestFunctionCount = 10;
+
+static int reportStatistics(const monty::drv::Cli &cli,
+                            const monty::stats::Statistics *stats,
+                            int exitCode) {
+  if (!stats)
+    return exitCode;
+
+  if (cli.time_report)
+    stats->printReport(llvm::errs(), slowestFunctionCount);
+  if (!cli.stats_json.empty() &&
+      !stats->writeJSON(cli.stats_json, slowestFunctionCount))
+    return 1;
+  return exitCode;
+}
+
+// Fast-math flags and contraction from the command line. An explicit
+// --fp-contract takes precedence over -ffast-math and --fp-flags.
+static void setFPOptions(const monty::drv::Cli &cli,
+                         monty::gen::CodeGenOptions &options) {
+  if (cli.fast_math) {
+    options.fastMath.setFast();
+    options.fastMath.setAllowContract(false);
+    options.fpContract = monty::gen::FPContract::Fast;
+  }
+
+  for (const std::string &flag : cli.fp_flags) {
+    if (flag == "nnan")
+      options.fastMath.setNoNaNs();
+    else if (flag == "ninf")
+      options.fastMath.setNoInfs();
+    else if (flag == "nsz")
+      options.fastMath.setNoSignedZeros();
+    else if (flag == "reassoc")
+      options.fastMath.setAllowReassoc();
+    else if (flag == "contract")
+      options.fpContract = monty::gen::FPContract::Fast;
+  }
+
+  if (cli.fp_contract == "off")
+    options.fpContract = monty::gen::FPContract::Off;
+  else if (cli.fp_contract == "on")
+    options.fpContract = monty::gen::FPContract::On;
+  else if (cli.fp_contract == "fast")
+    options.fpContract = monty::gen::FPContract::Fast;
+}
 
 int main(int argc, char *argv[]) {
 
@@ -25,74 +76,172 @@ int main(int argc, char *argv[]) {
       return 0;
     }
 
-    std::filebuf fb;
-    if (!fb.open(cli.source_file, std::ios::in)) {
-      llvm::errs() << "Error could not open file" << cli.source_file << '\n';
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmParsers();
+    llvm::InitializeAllAsmPrinters();
+
+    monty::gen::CodeGenOptions options;
+    options.optLevel = cli.opt_level;
+    options.sizeLevel = cli.size_level;
+    options.cpu = cli.cpu;
+    options.features = cli.target_features;
+    options.constEvalSteps = cli.const_eval_steps;
+    options.exportOperators = cli.export_operators;
+    options.wholeProgram = cli.whole_program;
+    options.exports = cli.exports;
+    options.profileGenerate = cli.profile_generate;
+    if (!cli.profile_file.empty())
+      options.profileFile = cli.profile_file;
+    options.profileUse = cli.profile_use;
+    if (!options.profileUse.empty() &&
+        !llvm::sys::fs::exists(options.profileUse))
+      throw std::runtime_error("Error: Could not find the profile " +
+                               options.profileUse);
+    setFPOptions(cli, options);
+    monty::gen::resolveHostTarget(options);
+
+    std::unique_ptr<monty::stats::Statistics> stats;
+    if (cli.time_report || !cli.stats_json.empty()) {
+      stats = std::make_unique<monty::stats::Statistics>();
+      // Collect LLVM pass statistics for the report instead of printing them
+      llvm::EnableStatistics(/*DoPrintOnExit=*/false);
     }
 
-    std::istream sourceFile(&fb);
-
-    // Needs to be accesed by both the generator and the parser
-    std::map<char, int> binopPrecedence;
-    binopPrecedence['='] = 2;
-    binopPrecedence['<'] = 10;
-    binopPrecedence['+'] = 20;
-    binopPrecedence['-'] = 20;
-    binopPrecedence['*'] = 40;
-
-    monty::gen::CodeGenerator generator{binopPrecedence};
-
-    // Old Jit compiler code
-    // llvm::InitializeNativeTarget();
-    // llvm::InitializeNativeTargetAsmPrinter();
-    // llvm::InitializeNativeTargetAsmParser();
-
-    // Error tracker
-    monty::syn::Diagnostics diag;
-    monty::syn::Parser parser{diag, binopPrecedence, sourceFile};
-    parser.getNextToken();
+    monty::drv::FrontendOptions frontend;
+    frontend.printIR = cli.print_ir;
+    frontend.stats = stats.get();
+
+    // Every source file is compiled in isolation on the worker pool. A single
+    // file gets the workers for its module partitions instead, as do whole
+    // programs and bitcode, which are emitted from one module linked from all
+    // files.
+    size_t fileCount = cli.source_files.size();
+    bool linkModules = cli.whole_program || cli.emit != "obj";
+    unsigned partitionThreads = fileCount == 1 || linkModules ? cli.jobs : 1;
+
+    std::unique_ptr<monty::gen::CompilationCache> cache;
+    if (!cli.cache_dir.empty())
+      cache = std::make_unique<monty::gen::CompilationCache>(
+          cli.cache_dir, uint64_t(cli.cache_max_size) << 20);
+
+    std::vector<std::unique_ptr<monty::drv::CompilationUnit>> units(fileCount);
+    std::vector<std::vector<monty::gen::ObjectBuffer>> fileObjects(fileCount);
+    std::atomic<bool> failed{false};
+
+    llvm::DefaultThreadPool pool(llvm::hardware_concurrency(cli.jobs));
+    for (size_t i = 0; i < fileCount; ++i) {
+      pool.async([&, i] {
+        units[i] =
+            monty::drv::compileSource(cli.source_files[i], options, frontend);
+        if (!units[i]) {
+          failed = true;
+          return;
+        }
+
+        // The JIT takes the modules as they are, the others are linked into
+        // one module first
+        if (cli.run_jit || linkModules)
+          return;
+
+        llvm::Module &module = *units[i]->generator->llvmModule;
+        fileObjects[i] =
+            cache ? monty::gen::emitCachedObjects(module, options, *cache,
+                                                  partitionThreads, stats.get())
+                  : monty::gen::emitObjects(module, options, partitionThreads,
+                                            stats.get());
+        if (fileObjects[i].empty())
+          failed = true;
+      });
+    }
+    pool.wait();
 
-    monty::drv::process(generator, parser);
+    if (failed)
+      return 1;
 
-    if (diag.hasErrors()) {
-      diag.printErors();
-      return -1;
+    if (linkModules) {
+      monty::stats::PhaseTimer timer(stats.get(),
+                                     monty::stats::Phase::Optimize);
+      if (!monty::drv::linkUnits(units))
+        return 1;
     }
 
-    auto fileName = "output.o";
-    std::error_code EC;
-    llvm::raw_fd_ostream dest(fileName, EC, llvm::sys::fs::OF_None);
-    if (EC) {
-      llvm::errs() << "Could not open file: " << EC.message();
-      return 1;
+    if (cli.emit != "obj") {
+      std::error_code EC;
+      llvm::raw_fd_ostream dest(cli.output_file, EC, llvm::sys::fs::OF_None);
+      if (EC) {
+        llvm::errs() << "Could not open file: " << EC.message();
+        return 1;
+      }
+      auto kind = cli.emit == "thin-bc" ? monty::gen::BitcodeKind::Thin
+                                        : monty::gen::BitcodeKind::Full;
+      if (!monty::gen::emitBitcode(*units[0]->generator->llvmModule, options,
+                                   kind, dest, stats.get()))
+        return 1;
+
+      llvm::outs() << "Wrote to " << cli.output_file << "\n";
+      return reportStatistics(cli, stats.get(), 0);
     }
 
-    llvm::legacy::PassManager pass;
-    auto fileType = llvm::CodeGenFileType::ObjectFile;
+    if (cli.whole_program) {
+      fileObjects[0] =
+          monty::gen::emitObjects(*units[0]->generator->llvmModule, options,
+                                  partitionThreads, stats.get());
+      if (fileObjects[0].empty())
+        return 1;
+    }
 
-    if (generator.targetMachine->addPassesToEmitFile(pass, dest, nullptr,
-                                                     fileType)) {
-      llvm::errs() << "TargetMachine can't emit a file of this type";
-      return 1;
+    if (cli.run_jit) {
+      std::vector<llvm::orc::ThreadSafeModule> modules;
+      for (auto &unit : units)
+        modules.emplace_back(std::move(unit->generator->llvmModule),
+                             std::move(unit->generator->llvmContext));
+      int exitCode = monty::jit::run(std::move(modules), options);
+      return reportStatistics(cli, stats.get(), exitCode);
     }
 
-    pass.run(*generator.llvmModule);
-    dest.flush();
+    if (cache) {
+      cache->prune();
+      if (cli.cache_stats)
+        cache->printStatistics(llvm::errs());
+    }
 
-    // generator.llvmModule->print(llvm::errs(), nullptr);
+    // Objects are linked in command line order, independent of scheduling
+    std::vector<monty::gen::ObjectBuffer> objects;
+    for (auto &buffers : fileObjects)
+      for (auto &buffer : buffers)
+        objects.push_back(std::move(buffer));
 
-    fb.close();
+    monty::stats::PhaseTimer linkTimer(stats.get(), monty::stats::Phase::Link);
 
     if (!cli.compile_only) {
-      monty::drv::linkToRuntime(cli.output_file);
-      monty::drv::cleanUp(fileName);
+      std::string runtime = cli.runtime_library.empty()
+                                ? monty::drv::defaultRuntimeLibrary(argv[0])
+                                : cli.runtime_library;
+      monty::drv::linkToRuntime(objects, runtime, cli.output_file,
+                                cli.profile_generate);
+
+      linkTimer.stop();
+      return reportStatistics(cli, stats.get(), 0);
+    }
 
-      return 0;
+    if (objects.size() == 1) {
+      std::error_code EC;
+      llvm::raw_fd_ostream dest(cli.output_file, EC, llvm::sys::fs::OF_None);
+      if (EC) {
+        llvm::errs() << "Could not open file: " << EC.message();
+        return 1;
+      }
+      dest.write(objects[0].data(), objects[0].size());
+    } else {
+      monty::drv::linkRelocatable(objects, cli.output_file);
     }
 
-    llvm::outs() << "Wrote to " << fileName << "\n";
+    linkTimer.stop();
+    llvm::outs() << "Wrote to " << cli.output_file << "\n";
 
-    return 0;
+    return reportStatistics(cli, stats.get(), 0);
   } catch (const std::exception &e) {
     llvm::errs() << e.what() << "\n";
     return 1;
@@ -0,0 +1,83 @@
+#include "../include/operators.hpp"
+#include <algorithm>
+#include <cassert>
+#include <llvm/ADT/StringExtras.h>
+
+namespace monty {
+namespace syn {
+
+bool isOperatorChar(char c) noexcept {
+  if (!llvm::isPunct(c))
+    return false;
+
+  switch (c) {
+  case '(':
+  case ')':
+  case '[':
+  case ']':
+  case '{':
+  case '}':
+  case ',':
+  case ';':
+  case '#':
+  case '.':
+  case '_':
+    return false;
+  default:
+    return true;
+  }
+}
+
+OperatorTable::OperatorTable(ast::Interner &_symbols) : symbols(_symbols) {
+  // Assignment groups to the right, `a = b = c` assigns c to both
+  defineBinary("=", 2, Associativity::Right);
+  defineBinary("<", 10, Associativity::Left);
+  defineBinary("+", 20, Associativity::Left);
+  defineBinary("-", 20, Associativity::Left);
+  defineBinary("*", 40, Associativity::Left);
+}
+
+unsigned OperatorTable::define(llvm::StringRef spelling) {
+  assert(!spelling.empty() && isOperatorChar(spelling.front()));
+
+  auto &candidates =
+      this->byFirstChar[static_cast<unsigned char>(spelling.front())];
+  for (unsigned id : candidates)
+    if (this->operators[id].spelling == spelling)
+      return id;
+
+  unsigned id = this->operators.size();
+  this->operators.push_back(
+      {spelling.str(), this->symbols.intern(spelling), 0,
+       Associativity::Left});
+
+  // Keep the longest spellings first so that matchPrefix can stop at the
+  // first hit.
+  auto pos = std::find_if(candidates.begin(), candidates.end(),
+                          [&](unsigned other) {
+                            return this->operators[other].spelling.size() <
+                                   spelling.size();
+                          });
+  candidates.insert(pos, id);
+  return id;
+}
+
+void OperatorTable::defineBinary(llvm::StringRef spelling, int precedence,
+                                 Associativity associativity) {
+  OperatorInfo &info = this->operators[define(spelling)];
+  info.precedence = precedence;
+  info.associativity = associativity;
+}
+
+int OperatorTable::matchPrefix(llvm::StringRef run) const noexcept {
+  if (run.empty() || !isOperatorChar(run.front()))
+    return -1;
+
+  unsigned char first = static_cast<unsigned char>(run.front());
+  for (unsigned id : this->byFirstChar[first])
+    if (run.starts_with(this->operators[id].spelling))
+      return id;
+  return -1;
+}
+} // namespace syn
+} // namespace monty
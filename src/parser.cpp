@@ -1,38 +1,66 @@
 #include "../include/parser.hpp"
+#include <cassert>
 #include <cctype>
-#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <charconv>
+#include <cstring>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringSwitch.h>
 #include <memory>
+#include <system_error>
 #include <vector>
 
 namespace monty {
 namespace syn {
-std::unique_ptr<ast::ExprAST> Parser::parseExpression() noexcept {
+// Pratt parser: parse a unary operand, then fold in binary operators for as
+// long as they bind at least as tightly as `minPrecedence`
+ast::ExprRef Parser::parseExpression(int minPrecedence) noexcept {
   auto Lhs = parseUnary();
   if (!Lhs)
-    return nullptr;
+    return {};
+
+  while (const OperatorInfo *op = getBinaryOperator()) {
+    if (op->precedence < minPrecedence)
+      break;
+
+    // A right associative operator accepts itself on its right-hand side
+    int rhsPrecedence = op->associativity == Associativity::Left
+                            ? op->precedence + 1
+                            : op->precedence;
+    ast::Symbol binOp = op->symbol;
+    getNextToken(); // eat bin op
+
+    auto Rhs = parseExpression(rhsPrecedence);
+    if (!Rhs)
+      return {};
 
-  return parseBinOpRhs(0, std::move(Lhs));
+    // Combine Lhs and Rhs.
+    Lhs = this->exprPool.addBinary(binOp, Lhs, Rhs);
+  }
+
+  return Lhs;
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parseIdentifierExpr() noexcept {
-  std::string idName = identifierStr;
+ast::ExprRef Parser::parseIdentifierExpr() noexcept {
+  ast::Symbol idName = this->symbols.intern(identifierStr);
 
   // eat identifier
   getNextToken();
 
   if (curToken != '(')
-    return std::make_unique<ast::VariableExprAST>(idName);
+    return this->exprPool.addVariable(idName);
 
   // Function call
   getNextToken();
-  std::vector<std::unique_ptr<ast::ExprAST>> args;
+  llvm::SmallVector<ast::ExprRef, 4> args;
 
   if (curToken != ')') {
     while (true) {
       if (auto arg = parseExpression())
-        args.push_back(std::move(arg));
+        args.push_back(arg);
       else
-        return nullptr;
+        return {};
 
       if (curToken == ')')
         break;
@@ -45,61 +73,77 @@ std::unique_ptr<ast::ExprAST> Parser::parseIdentifierExpr() noexcept {
   }
 
   // eat the ')'
-  return std::make_unique<ast::FunctionCallExprAST>(idName, std::move(args));
+  getNextToken();
+  return this->exprPool.addCall(idName, args);
 }
 
-std::unique_ptr<ast::ExprAST>
-Parser::parseBinOpRhs(int exprPrec,
-                      std::unique_ptr<ast::ExprAST> Lhs) noexcept {
-  // find precedence of bin op
-  while (true) {
-    int tokenPrec = getTokenPrecedence();
-
-    if (tokenPrec < exprPrec)
-      return Lhs;
+ast::ExprRef Parser::parseUnary() noexcept {
+  // If the current token is not an operator, it must be a primary expr.
+  if (this->curToken != token_operator)
+    return parsePostfix();
 
-    // is a binary operation
-    int binOp = curToken;
-    getNextToken(); // eat bin op
+  // If this is a unary operator, read it.
+  ast::Symbol opc = this->operatorId >= 0
+                        ? this->operators.get(this->operatorId).symbol
+                        : this->symbols.intern(this->identifierStr);
+  getNextToken();
+  if (auto Operand = parseUnary())
+    return this->exprPool.addUnary(opc, Operand);
+  return {};
+}
 
-    auto Rhs = parseUnary();
-    if (!Rhs)
-      return nullptr;
+// A primary expression followed by any number of lane accesses `[lane]`
+ast::ExprRef Parser::parsePostfix() noexcept {
+  auto expr = parsePrimery();
+  while (expr && this->curToken == '[') {
+    getNextToken(); // eat [.
+
+    // Lanes are selected at compile time
+    if (this->curToken != token_number || this->numVal < 0 ||
+        this->numVal != (uint32_t)this->numVal)
+      return logError("expected a lane number");
+    uint32_t lane = (uint32_t)this->numVal;
+    getNextToken();
 
-    int nextPrec = getTokenPrecedence();
-    if (tokenPrec < nextPrec) {
-      Rhs = parseBinOpRhs(tokenPrec + 1, std::move(Rhs));
-      if (!Rhs)
-        return nullptr;
-    }
+    if (this->curToken != ']')
+      return logError("expected ']'");
+    getNextToken(); // eat ].
 
-    // Combine Lhs and Rhs.
-    Lhs = std::make_unique<ast::BinaryExprAST>(binOp, std::move(Lhs),
-                                               std::move(Rhs));
+    expr = this->exprPool.addIndex(expr, lane);
   }
+  return expr;
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parseUnary() noexcept {
-  // If the current token is not an operator, it must be a primary expr.
-  if (!isascii(this->curToken) || this->curToken == '(' ||
-      this->curToken == ',')
-    return parsePrimery();
+ast::ExprRef Parser::parseVectorExpr() noexcept {
+  getNextToken(); // eat [.
+  llvm::SmallVector<ast::ExprRef, 8> elements;
 
-  // If this is a unary operator, read it.
-  int opc = this->curToken;
-  getNextToken();
-  if (auto Operand = parseUnary())
-    return std::make_unique<ast::UnaryExprAST>(opc, std::move(Operand));
-  return nullptr;
+  while (true) {
+    if (auto element = parseExpression())
+      elements.push_back(element);
+    else
+      return {};
+
+    if (this->curToken == ']')
+      break;
+
+    if (this->curToken != ',')
+      return logError("Expected ']' or ',' in vector");
+
+    getNextToken();
+  }
+
+  getNextToken(); // eat ].
+  return this->exprPool.addVector(elements);
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parseIfExpr() noexcept {
+ast::ExprRef Parser::parseIfExpr() noexcept {
   getNextToken(); // eat the if.
 
   // condition.
   auto cond = parseExpression();
   if (!cond)
-    return nullptr;
+    return {};
 
   if (this->curToken != token_then)
     return logError("expected then");
@@ -107,7 +151,7 @@ std::unique_ptr<ast::ExprAST> Parser::parseIfExpr() noexcept {
 
   auto then = parseExpression();
   if (!then)
-    return nullptr;
+    return {};
 
   if (this->curToken != token_else)
     return logError("expected else");
@@ -116,36 +160,35 @@ std::unique_ptr<ast::ExprAST> Parser::parseIfExpr() noexcept {
 
   auto otherwise = parseExpression();
   if (!otherwise)
-    return nullptr;
+    return {};
 
-  return std::make_unique<ast::IfExprAST>(std::move(cond), std::move(then),
-                                          std::move(otherwise));
+  return this->exprPool.addIf(cond, then, otherwise);
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parseLetExpr() noexcept {
+ast::ExprRef Parser::parseLetExpr() noexcept {
   getNextToken(); // eat the let
 
-  std::vector<std::pair<std::string, std::unique_ptr<ast::ExprAST>>> varNames;
+  llvm::SmallVector<ast::LetBinding, 4> varNames;
 
   // At least one variable name is required.
   if (this->curToken != token_identifier)
     return logError("expected identifier after let");
 
   while (true) {
-    std::string name = this->identifierStr;
+    ast::Symbol name = this->symbols.intern(this->identifierStr);
     getNextToken(); // eat identifier.
 
     // Read the optional initializer.
-    std::unique_ptr<ast::ExprAST> init;
-    if (this->curToken == '=') {
+    ast::ExprRef init;
+    if (isOperator("=")) {
       getNextToken(); // eat the '='.
 
       init = parseExpression();
       if (!init)
-        return nullptr;
+        return {};
     }
 
-    varNames.push_back(std::make_pair(name, std::move(init)));
+    varNames.push_back({name, init});
 
     // End of let list, exit loop.
     if (this->curToken != ',')
@@ -163,13 +206,66 @@ std::unique_ptr<ast::ExprAST> Parser::parseLetExpr() noexcept {
 
   auto body = parseExpression();
   if (!body)
-    return nullptr;
+    return {};
+
+  return this->exprPool.addLet(varNames, body);
+}
+
+ast::ExprRef Parser::parseForExpr() noexcept {
+  getNextToken(); // eat the for.
+
+  if (this->curToken != token_identifier)
+    return logError("expected identifier after for");
+  ast::ForExprAST node = {};
+  node.var = this->symbols.intern(this->identifierStr);
+  getNextToken(); // eat identifier.
+
+  if (!isOperator("="))
+    return logError("expected '=' after for");
+  getNextToken(); // eat '='.
+
+  if (!(node.start = parseExpression()))
+    return {};
+  if (this->curToken != ',')
+    return logError("expected ',' after for start value");
+  getNextToken();
+
+  if (!(node.end = parseExpression()))
+    return {};
+
+  // The step value is optional.
+  if (this->curToken == ',') {
+    getNextToken();
+    if (!(node.step = parseExpression()))
+      return {};
+  }
+
+  // So is the accumulator, but it needs an initial value.
+  if (this->curToken == token_with) {
+    getNextToken(); // eat 'with'.
+    if (this->curToken != token_identifier)
+      return logError("expected accumulator after 'with'");
+    node.accumulator = this->symbols.intern(this->identifierStr);
+    getNextToken(); // eat identifier.
+
+    if (!isOperator("="))
+      return logError("expected '=' after the accumulator");
+    getNextToken(); // eat '='.
+    if (!(node.init = parseExpression()))
+      return {};
+  }
+
+  if (this->curToken != token_in)
+    return logError("expected 'in' after for");
+  getNextToken(); // eat 'in'.
 
-  return std::make_unique<ast::LetExprAST>(std::move(varNames),
-                                           std::move(body));
+  if (!(node.body = parseExpression()))
+    return {};
+
+  return this->exprPool.addFor(node);
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parsePrimery() noexcept {
+ast::ExprRef Parser::parsePrimery() noexcept {
   switch (curToken) {
   case token_identifier:
     return parseIdentifierExpr();
@@ -177,28 +273,34 @@ std::unique_ptr<ast::ExprAST> Parser::parsePrimery() noexcept {
     return parseNumberExpr();
   case '(':
     return parseParenExpr();
+  case '[':
+    return parseVectorExpr();
   case token_if:
     return parseIfExpr();
   case token_let:
     return parseLetExpr();
+  case token_for:
+    return parseForExpr();
   case token_eof:
-    return nullptr;
+    return {};
   default:
     return logError("Unknown token when expecting an expression");
   }
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parseNumberExpr() noexcept {
-  auto result = std::make_unique<ast::NumberExprAST>(numVal);
+ast::ExprRef Parser::parseNumberExpr() noexcept {
+  auto result = this->exprPool.addNumber(numVal);
   getNextToken(); // consume the number
   return result;
 }
 
 std::unique_ptr<ast::FunctionPrototypeAST> Parser::parsePrototype() noexcept {
-  std::string fnName;
+  llvm::SmallString<16> fnName;
+  llvm::StringRef opSpelling;
 
   unsigned kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned binaryPrecedence = 30;
+  Associativity associativity = Associativity::Left;
 
   switch (this->curToken) {
   default:
@@ -209,20 +311,25 @@ std::unique_ptr<ast::FunctionPrototypeAST> Parser::parsePrototype() noexcept {
     getNextToken();
     break;
   case token_unary:
+    // The operator being defined is not known yet, take all of its characters
+    this->lexOperatorRun = true;
     getNextToken();
-    if (!isascii(this->curToken))
+    if (this->curToken != token_operator)
       return logErrorP("Expected unary operator");
+    opSpelling = this->identifierStr;
     fnName = "unary";
-    fnName += (char)this->curToken;
+    fnName += opSpelling;
     kind = 1;
     getNextToken();
     break;
   case token_binary:
+    this->lexOperatorRun = true;
     getNextToken();
-    if (!isascii(this->curToken))
+    if (this->curToken != token_operator)
       return logErrorP("Expected binary operator");
+    opSpelling = this->identifierStr;
     fnName = "binary";
-    fnName += (char)this->curToken;
+    fnName += opSpelling;
     kind = 2;
     getNextToken();
 
@@ -233,46 +340,145 @@ std::unique_ptr<ast::FunctionPrototypeAST> Parser::parsePrototype() noexcept {
       binaryPrecedence = (unsigned)this->numVal;
       getNextToken();
     }
+
+    // Read the associativity if present, operators group left by default.
+    if (this->curToken == token_identifier &&
+        (this->identifierStr == "left" || this->identifierStr == "right")) {
+      if (this->identifierStr == "right")
+        associativity = Associativity::Right;
+      getNextToken();
+    }
     break;
   }
 
   if (this->curToken != '(')
     return logErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> argNames;
-  while (getNextToken() == token_identifier)
-    argNames.push_back(this->identifierStr);
+  // Every argument may be followed by its type, `v: vec<4>`
+  std::vector<ast::Symbol> argNames;
+  std::vector<ast::Type> argTypes;
+  getNextToken();
+  while (this->curToken == token_identifier) {
+    argNames.push_back(this->symbols.intern(this->identifierStr));
+    argTypes.emplace_back();
+    getNextToken();
+
+    if (isOperator(":")) {
+      getNextToken();
+      if (!parseType(argTypes.back()))
+        return nullptr;
+    }
+  }
   if (this->curToken != ')')
     return logErrorP("Expected ')' in prototype");
 
   // success.
   getNextToken(); // eat ')'.
 
+  // The result type follows the arguments, it defaults to a double
+  ast::Type returnType;
+  if (isOperator(":")) {
+    getNextToken();
+    if (!parseType(returnType))
+      return nullptr;
+  }
+
   // Verify right number of names for operator.
   if (kind && argNames.size() != kind)
     return logErrorP("Invalid number of operands for operator");
 
-  return std::make_unique<ast::FunctionPrototypeAST>(
-      fnName, std::move(argNames), kind != 0, binaryPrecedence);
+  // Install the operator so that it can be used from here on, including in
+  // the body of its own definition.
+  if (kind == 1)
+    this->operators.define(opSpelling);
+  else if (kind == 2)
+    this->operators.defineBinary(opSpelling, binaryPrecedence, associativity);
+
+  auto proto = std::make_unique<ast::FunctionPrototypeAST>(
+      this->symbols.intern(fnName), std::move(argNames), kind != 0,
+      binaryPrecedence);
+  proto->setTypes(std::move(argTypes), returnType);
+  return proto;
+}
+
+// `double` or `vec<N>`
+bool Parser::parseType(ast::Type &type) noexcept {
+  if (this->curToken != token_identifier ||
+      (this->identifierStr != "double" && this->identifierStr != "vec")) {
+    logError("Expected a type, 'double' or 'vec<N>'");
+    return false;
+  }
+
+  if (this->identifierStr == "double") {
+    getNextToken();
+    type = ast::Type();
+    return true;
+  }
+
+  getNextToken(); // eat vec.
+  if (!isOperator("<")) {
+    logError("Expected '<' after 'vec'");
+    return false;
+  }
+  getNextToken();
+
+  if (this->curToken != token_number || this->numVal < 1 ||
+      this->numVal > 1024 || this->numVal != (uint32_t)this->numVal) {
+    logError("Invalid vector width: must be 1..1024");
+    return false;
+  }
+  type.lanes = (uint32_t)this->numVal;
+  getNextToken();
+
+  if (!isOperator(">")) {
+    logError("Expected '>' after the vector width");
+    return false;
+  }
+  getNextToken();
+  return true;
 }
 
 std::unique_ptr<ast::FunctionAST> Parser::parseDefinition() noexcept {
   getNextToken(); // eat def.
+
+  // Annotations precede the prototype, in any order
+  bool tailRecursive = false;
+  ast::FPMode fpMode = ast::FPMode::Default;
+  while (true) {
+    if (this->curToken == token_tailrec) {
+      tailRecursive = true;
+    } else if (this->curToken == token_fast ||
+               this->curToken == token_strict) {
+      ast::FPMode mode = this->curToken == token_fast ? ast::FPMode::Fast
+                                                      : ast::FPMode::Strict;
+      if (fpMode != ast::FPMode::Default && fpMode != mode) {
+        logErrorP("A function cannot be both 'fast' and 'strict'");
+        return nullptr;
+      }
+      fpMode = mode;
+    } else {
+      break;
+    }
+    getNextToken();
+  }
+
   auto Proto = parsePrototype();
   if (!Proto)
     return nullptr;
+  Proto->setTailRecursive(tailRecursive);
+  Proto->setFPMode(fpMode);
 
   if (auto E = parseExpression())
-    return std::make_unique<ast::FunctionAST>(std::move(Proto), std::move(E));
+    return std::make_unique<ast::FunctionAST>(std::move(Proto), E);
   return nullptr;
 }
 
-std::unique_ptr<ast::ExprAST> Parser::logError(const char *str) const noexcept {
-  diag.report(str, curLoc);
-  return nullptr;
+ast::ExprRef Parser::logError(const char *str) noexcept {
+  diag.report(str, getLocation(this->tokenStart));
+  return {};
 }
 std::unique_ptr<ast::FunctionPrototypeAST>
-Parser::logErrorP(const char *Str) const noexcept {
+Parser::logErrorP(const char *Str) noexcept {
   logError(Str);
   return nullptr;
 }
@@ -286,18 +492,17 @@ std::unique_ptr<ast::FunctionAST> Parser::parseTopLevelExpr() noexcept {
   if (auto expr = parseExpression()) {
     // Make an anonymous proto.
     auto proto = std::make_unique<ast::FunctionPrototypeAST>(
-        "__anon_expr", std::vector<std::string>());
-    return std::make_unique<ast::FunctionAST>(std::move(proto),
-                                              std::move(expr));
+        this->symbols.intern("__anon_expr"), std::vector<ast::Symbol>());
+    return std::make_unique<ast::FunctionAST>(std::move(proto), expr);
   }
   return nullptr;
 }
 
-std::unique_ptr<ast::ExprAST> Parser::parseParenExpr() noexcept {
+ast::ExprRef Parser::parseParenExpr() noexcept {
   getNextToken(); // eat (.
   auto V = parseExpression();
   if (!V)
-    return nullptr;
+    return {};
 
   if (curToken != ')')
     return logError("expected ')'");
@@ -309,92 +514,111 @@ std::unique_ptr<ast::ExprAST> Parser::parseParenExpr() noexcept {
 int Parser::getNextToken() noexcept { return curToken = getToken(); }
 
 int Parser::getToken() noexcept {
-  // Skip any whitespace.
-  while (isspace(lastChar))
-    lastChar = getNextChar();
-
-  // Store location of new token
-  curLoc = {currentLine, currentCol};
-
-  if (isalpha(lastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    identifierStr = lastChar;
-    while (isalnum((lastChar = getNextChar())))
-      identifierStr += lastChar;
-
-    if (identifierStr == "fn")
-      return token_def;
-    if (identifierStr == "using")
-      return token_extern;
-    if (identifierStr == "if")
-      return token_if;
-    if (identifierStr == "then")
-      return token_then;
-    if (identifierStr == "else")
-      return token_else;
-    if (identifierStr == "binary")
-      return token_binary;
-    if (identifierStr == "unary")
-      return token_unary;
-    if (identifierStr == "let")
-      return token_let;
-    if (identifierStr == "in")
-      return token_in;
-
-    return token_identifier;
-  }
+  bool wholeRun = this->lexOperatorRun;
+  this->lexOperatorRun = false;
 
-  if (isdigit(lastChar) || lastChar == '.') { // Number: [0-9.]+
-    std::string numStr;
-    do {
-      numStr += lastChar;
-      lastChar = getNextChar();
-    } while (isdigit(lastChar) || lastChar == '.');
+  while (true) {
+    // Skip any whitespace.
+    while (bufferPtr != bufferEnd && llvm::isSpace(*bufferPtr))
+      ++bufferPtr;
+
+    tokenStart = bufferPtr;
+
+    // Check for end of file.
+    if (bufferPtr == bufferEnd)
+      return token_eof;
+
+    if (llvm::isAlpha(*bufferPtr)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+      do
+        ++bufferPtr;
+      while (bufferPtr != bufferEnd && llvm::isAlnum(*bufferPtr));
+      identifierStr = llvm::StringRef(tokenStart, bufferPtr - tokenStart);
+
+      return llvm::StringSwitch<int>(identifierStr)
+          .Case("fn", token_def)
+          .Case("using", token_extern)
+          .Case("if", token_if)
+          .Case("then", token_then)
+          .Case("else", token_else)
+          .Case("binary", token_binary)
+          .Case("unary", token_unary)
+          .Case("let", token_let)
+          .Case("in", token_in)
+          .Case("tailrec", token_tailrec)
+          .Case("for", token_for)
+          .Case("with", token_with)
+          .Case("fast", token_fast)
+          .Case("strict", token_strict)
+          .Default(token_identifier);
+    }
 
-    numVal = strtod(numStr.c_str(), nullptr);
-    return token_number;
-  }
+    if (llvm::isDigit(*bufferPtr) || *bufferPtr == '.') { // Number: [0-9.]+
+      do
+        ++bufferPtr;
+      while (bufferPtr != bufferEnd &&
+             (llvm::isDigit(*bufferPtr) || *bufferPtr == '.'));
 
-  if (lastChar == '#') {
-    // Comment until end of line.
-    do
-      lastChar = getNextChar();
-    while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
+      // Like strtod, use the longest valid prefix and 0 if there is none
+      if (std::from_chars(tokenStart, bufferPtr, numVal).ec != std::errc())
+        numVal = 0.0;
+      return token_number;
+    }
 
-    if (lastChar != EOF)
-      return getToken();
-  }
+    if (*bufferPtr == '#') {
+      // Comment until end of line.
+      size_t eol = llvm::StringRef(bufferPtr, bufferEnd - bufferPtr)
+                       .find_first_of("\r\n");
+      bufferPtr = eol == llvm::StringRef::npos ? bufferEnd : bufferPtr + eol;
+      continue;
+    }
 
-  // Check for end of file.  Don't eat the EOF.
-  if (lastChar == EOF)
-    return token_eof;
+    if (isOperatorChar(*bufferPtr)) {
+      const char *runEnd = bufferPtr;
+      while (runEnd != bufferEnd && isOperatorChar(*runEnd))
+        ++runEnd;
+      llvm::StringRef run(bufferPtr, runEnd - bufferPtr);
+
+      // Split the run at the longest known operator, so that `a<-b` is `<`
+      // followed by `-`. Unknown operators are lexed one character at a time.
+      size_t length = wholeRun ? run.size() : 1;
+      this->operatorId = wholeRun ? -1 : this->operators.matchPrefix(run);
+      if (this->operatorId >= 0)
+        length = this->operators.get(this->operatorId).spelling.size();
+
+      identifierStr = run.take_front(length);
+      bufferPtr += length;
+      return token_operator;
+    }
 
-  // Otherwise, just return the character as its ascii value.
-  int ThisChar = lastChar;
-  lastChar = getNextChar();
-  return ThisChar;
+    // Otherwise, just return the character as its ascii value.
+    return static_cast<unsigned char>(*bufferPtr++);
+  }
 }
 
-int Parser::getTokenPrecedence() const noexcept {
-  if (!isascii(curToken))
-    return -1; // return invalid token code
+SourceLoc Parser::getLocation(const char *pos) noexcept {
+  // Diagnostics are reported front to back, so only the newlines since the
+  // last request need to be counted.
+  assert(pos >= locPtr && "locations must be requested in source order");
 
-  int tokenPrec = binopPrecedence[curToken];
-  if (tokenPrec <= 0) // Invalid token
-    return -1;
+  while (const void *nl = std::memchr(locPtr, '\n', pos - locPtr)) {
+    ++locLine;
+    locPtr = lineStart = static_cast<const char *>(nl) + 1;
+  }
+  locPtr = pos;
 
-  return tokenPrec;
+  return {locLine, static_cast<int>(pos - lineStart) + 1};
 }
 
-int Parser::getNextChar() noexcept {
-  int c = this->inputStream.get();
-  if (c == '\n') {
-    currentLine++;
-    currentCol = 0;
-  } else {
-    currentCol++;
-  }
+bool Parser::isOperator(llvm::StringRef spelling) const noexcept {
+  return this->curToken == token_operator && this->identifierStr == spelling;
+}
+
+const OperatorInfo *Parser::getBinaryOperator() const noexcept {
+  if (this->curToken != token_operator || this->operatorId < 0)
+    return nullptr;
 
-  return c;
+  const OperatorInfo &op = this->operators.get(this->operatorId);
+  return op.precedence > 0 ? &op : nullptr;
 }
 
 void Parser::synchronize() noexcept {
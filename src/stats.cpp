@@ -0,0 +1,183 @@
+#include "../include/stats.hpp"
+#include <algorithm>
+#include <chrono>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <sys/resource.h>
+#include <time.h>
+
+namespace monty {
+namespace stats {
+
+const char *getPhaseName(Phase phase) noexcept {
+  switch (phase) {
+  case Phase::Parse:
+    return "parse";
+  case Phase::Fold:
+    return "fold";
+  case Phase::IRGen:
+    return "irgen";
+  case Phase::Verify:
+    return "verify";
+  case Phase::Optimize:
+    return "optimize";
+  case Phase::CodeGen:
+    return "codegen";
+  case Phase::Link:
+    return "link";
+  }
+  return "unknown";
+}
+
+static double toSeconds(const timespec &time) noexcept {
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+PhaseTime PhaseTime::now() noexcept {
+  PhaseTime time;
+  time.wall = std::chrono::duration<double>(
+                  std::chrono::steady_clock::now().time_since_epoch())
+                  .count();
+
+  // Per thread CPU time, so that phases running concurrently on the worker
+  // threads are not charged for each other
+  timespec cpu;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0)
+    time.cpu = toSeconds(cpu);
+  return time;
+}
+
+// Wall time since `start` and CPU time of the whole process
+static PhaseTime getTotalTime(const PhaseTime &start) noexcept {
+  PhaseTime total;
+  total.wall = PhaseTime::now().wall - start.wall;
+
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    total.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+                usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+  return total;
+}
+
+uint64_t getPeakRSS() noexcept {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  // Linux reports kilobytes
+  return uint64_t(usage.ru_maxrss) * 1024;
+}
+
+void Statistics::addPhaseTime(Phase phase, const PhaseTime &time) noexcept {
+  std::lock_guard<std::mutex> guard(this->lock);
+  this->phases[static_cast<unsigned>(phase)] += time;
+}
+
+void Statistics::addFunctionTime(llvm::StringRef name, double wall) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  this->functionTimes[name.str()] += wall;
+}
+
+std::vector<std::pair<std::string, double>>
+Statistics::getSlowestFunctions(unsigned count) const {
+  std::lock_guard<std::mutex> guard(this->lock);
+  std::vector<std::pair<std::string, double>> slowest(
+      this->functionTimes.begin(), this->functionTimes.end());
+
+  count = std::min<size_t>(count, slowest.size());
+  std::partial_sort(
+      slowest.begin(), slowest.begin() + count, slowest.end(),
+      [](const auto &a, const auto &b) { return a.second > b.second; });
+  slowest.resize(count);
+  return slowest;
+}
+
+static void printRow(llvm::raw_ostream &os, const char *name,
+                     const PhaseTime &time) {
+  os << llvm::format("  %-10s %12.4f %12.4f\n", name, time.wall, time.cpu);
+}
+
+void Statistics::printReport(llvm::raw_ostream &os,
+                             unsigned topFunctions) const {
+  PhaseTime total = getTotalTime(this->start);
+
+  os << "===-------------------------------------------------------------===\n"
+     << "                      montyc time report\n"
+     << "===-------------------------------------------------------------===\n"
+     << "  phase          wall (s)      cpu (s)\n";
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    for (unsigned i = 0; i < numPhases; ++i)
+      printRow(os, getPhaseName(static_cast<Phase>(i)), this->phases[i]);
+  }
+  printRow(os, "total", total);
+
+  os << "\n  peak RSS:    " << getPeakRSS() / (1024 * 1024) << " MiB\n"
+     << "  expressions: " << this->expressions << "\n"
+     << "  functions:   " << this->functions << "\n"
+     << "  externs:     " << this->externs << "\n"
+     << "  folded:      " << this->foldedCalls << " calls\n"
+     << "  vectorized:  " << this->vectorizedLoops << " loops\n";
+
+  auto slowest = getSlowestFunctions(topFunctions);
+  if (!slowest.empty()) {
+    os << "\n  slowest functions (fold, irgen, verify and codegen):\n";
+    for (const auto &[name, wall] : slowest)
+      os << llvm::format("  %12.6f s  ", wall) << name << "\n";
+  }
+
+  // Only populated if LLVM was built with statistics enabled
+  llvm::PrintStatistics(os);
+}
+
+bool Statistics::writeJSON(llvm::StringRef path, unsigned topFunctions) const {
+  std::error_code EC;
+  llvm::raw_fd_ostream file(path, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    llvm::errs() << "Could not open file " << path << ": " << EC.message()
+                 << "\n";
+    return false;
+  }
+
+  auto writeTime = [](llvm::json::OStream &json, const PhaseTime &time) {
+    json.attribute("wall", time.wall);
+    json.attribute("cpu", time.cpu);
+  };
+
+  PhaseTime total = getTotalTime(this->start);
+  llvm::json::OStream json(file, 2);
+  json.object([&] {
+    json.attributeObject("total", [&] { writeTime(json, total); });
+    json.attributeObject("phases", [&] {
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (unsigned i = 0; i < numPhases; ++i)
+        json.attributeObject(getPhaseName(static_cast<Phase>(i)),
+                             [&] { writeTime(json, this->phases[i]); });
+    });
+    json.attribute("peak_rss_bytes", int64_t(getPeakRSS()));
+    json.attributeObject("counts", [&] {
+      json.attribute("expressions", int64_t(this->expressions));
+      json.attribute("functions", int64_t(this->functions));
+      json.attribute("externs", int64_t(this->externs));
+      json.attribute("folded_calls", int64_t(this->foldedCalls));
+      json.attribute("vectorized_loops", int64_t(this->vectorizedLoops));
+    });
+    json.attributeArray("slowest_functions", [&] {
+      for (const auto &[name, wall] : getSlowestFunctions(topFunctions))
+        json.object([&] {
+          json.attribute("name", name);
+          json.attribute("wall", wall);
+        });
+    });
+    json.attributeObject("llvm_statistics", [&] {
+      for (const auto &[name, value] : llvm::GetStatistics())
+        json.attribute(name, int64_t(value));
+    });
+  });
+  file << "\n";
+  return true;
+}
+
+} // namespace stats
+} // namespace monty
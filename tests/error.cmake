@@ -0,0 +1,19 @@
+# Compiles SOURCE, which has an error in one of its definitions, and checks
+# that montyc fails with the message ERROR instead of writing an object
+# without the definition. Run with
+#   cmake -DMONTYC=<montyc> -DSOURCE=<file.my> -DERROR=<message>
+#         -DWORK_DIR=<dir> -P error.cmake
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+execute_process(
+    COMMAND ${MONTYC} ${SOURCE} -c -o ${WORK_DIR}/error.o
+    ERROR_VARIABLE errors
+    RESULT_VARIABLE status)
+if (status EQUAL 0)
+  message(FATAL_ERROR "montyc accepted ${SOURCE}")
+endif()
+string(FIND "${errors}" "${ERROR}" found)
+if (found EQUAL -1)
+  message(FATAL_ERROR "montyc failed without reporting '${ERROR}':\n${errors}")
+endif()
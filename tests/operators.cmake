@@ -0,0 +1,47 @@
+# Compiles tests/operators.my at -O0 and checks with llvm-nm that the binary
+# operators were inlined and removed, and that --export-operators keeps them.
+# Run with
+#   cmake -DMONTYC=<montyc> -DLLVM_NM=<llvm-nm> -DSOURCE=<operators.my>
+#         -DWORK_DIR=<dir> -P operators.cmake
+cmake_policy(SET CMP0057 NEW) # if (... IN_LIST ...)
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# Compiles SOURCE to an object with the extra arguments and stores the names
+# of its symbols, local ones included, in `symbols`
+function(compile_symbols object)
+  execute_process(
+      COMMAND ${MONTYC} ${SOURCE} -O0 -c -o ${WORK_DIR}/${object} ${ARGN}
+      RESULT_VARIABLE status)
+  if (NOT status EQUAL 0)
+    message(FATAL_ERROR "montyc ${ARGN} failed: ${status}")
+  endif()
+  execute_process(
+      COMMAND ${LLVM_NM} --format=just-symbols ${WORK_DIR}/${object}
+      OUTPUT_VARIABLE output
+      RESULT_VARIABLE status)
+  if (NOT status EQUAL 0)
+    message(FATAL_ERROR "llvm-nm ${object} failed: ${status}")
+  endif()
+  string(REPLACE "\n" ";" output "${output}")
+  set(symbols ${output} PARENT_SCOPE)
+endfunction()
+
+compile_symbols(inlined.o)
+if (NOT "f" IN_LIST symbols)
+  message(FATAL_ERROR "f is missing from the object: ${symbols}")
+endif()
+foreach(operator "binary&" "binary|")
+  if (operator IN_LIST symbols)
+    message(FATAL_ERROR "${operator} was not inlined at -O0: ${symbols}")
+  endif()
+endforeach()
+
+compile_symbols(exported.o --export-operators)
+foreach(operator "f" "binary&" "binary|")
+  if (NOT operator IN_LIST symbols)
+    message(FATAL_ERROR "${operator} is missing with --export-operators: "
+                        "${symbols}")
+  endif()
+endforeach()
@@ -0,0 +1,25 @@
+# Compiles tests/profile.my with --profile-generate, runs the executable and
+# checks that it wrote a raw profile. Run with
+#   cmake -DMONTYC=<montyc> -DSOURCE=<profile.my> -DWORK_DIR=<dir> -P profile.cmake
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+execute_process(
+    COMMAND ${MONTYC} ${SOURCE} -O1 --profile-generate -o ${WORK_DIR}/profile
+    RESULT_VARIABLE status)
+if (NOT status EQUAL 0)
+  message(FATAL_ERROR "montyc --profile-generate failed: ${status}")
+endif()
+
+execute_process(COMMAND ${WORK_DIR}/profile
+                WORKING_DIRECTORY ${WORK_DIR}
+                OUTPUT_QUIET
+                RESULT_VARIABLE status)
+if (NOT status EQUAL 0)
+  message(FATAL_ERROR "the instrumented program failed: ${status}")
+endif()
+
+file(GLOB profiles ${WORK_DIR}/default_*.profraw)
+if (NOT profiles)
+  message(FATAL_ERROR "no default_*.profraw was written to ${WORK_DIR}")
+endif()
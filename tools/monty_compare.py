@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Compares the compile time and memory use of two montyc builds.
+
+Generates programs of increasing size with monty_gen and compiles each of them
+with both builds, e.g. a tree before and after a change to the AST. Every
+compile is repeated and the fastest run is kept. Wall time and peak memory are
+measured around the process, so builds that predate --stats-json are compared
+as well; the parse and irgen phases are reported for builds that write it.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+PHASES = ["parse", "irgen"]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--baseline", required=True,
+                        help="path to the montyc that is compared against")
+    parser.add_argument("--montyc", required=True, help="path to montyc")
+    parser.add_argument("--gen", required=True, help="path to monty_gen")
+    parser.add_argument("--vary", default="functions",
+                        choices=["functions", "depth", "let-depth", "fanout"],
+                        help="monty_gen option that is scaled")
+    parser.add_argument("--sizes", default="4000,16000,64000",
+                        help="comma separated values of the scaled option")
+    parser.add_argument("--opt", default="0", help="optimization level")
+    parser.add_argument("--runs", type=int, default=5,
+                        help="compiles per build and size, the fastest counts")
+    parser.add_argument("gen_args", nargs=argparse.REMAINDER,
+                        help="further monty_gen options, after --")
+    return parser.parse_args()
+
+
+def writes_stats(montyc):
+    help_text = subprocess.run([montyc, "--help"], capture_output=True,
+                               text=True).stdout
+    return "--stats-json" in help_text
+
+
+def compile_once(montyc, source, args, stats_file):
+    command = [montyc, source, "-O" + args.opt, "-c",
+               "-o", os.path.join(os.path.dirname(source), "out.o")]
+    if stats_file:
+        command.append("--stats-json=" + stats_file)
+
+    start = time.perf_counter()
+    process = subprocess.Popen(command)
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        sys.exit("%s failed on %s" % (montyc, source))
+
+    # ru_maxrss is in KiB on Linux
+    row = {"wall": wall, "peak_rss_mib": usage.ru_maxrss / 1024}
+    if stats_file:
+        with open(stats_file) as f:
+            stats = json.load(f)
+        for phase in PHASES:
+            row[phase] = stats["phases"][phase]["wall"]
+    return row
+
+
+def measure(montyc, source, args, stats_file):
+    runs = [compile_once(montyc, source, args, stats_file)
+            for _ in range(args.runs)]
+    return {key: min(run[key] for run in runs) for key in runs[0]}
+
+
+def main():
+    args = parse_args()
+    builds = [("baseline", args.baseline), ("montyc", args.montyc)]
+    stats = {name: writes_stats(path) for name, path in builds}
+    gen_args = [a for a in args.gen_args if a != "--"]
+
+    with tempfile.TemporaryDirectory(prefix="monty-compare") as work_dir:
+        for size in args.sizes.split(","):
+            size = size.strip()
+            source = os.path.join(work_dir, "gen-%s.my" % size)
+            subprocess.run([args.gen, "--%s=%s" % (args.vary, size),
+                            "-o", source] + gen_args, check=True)
+
+            rows = {}
+            for name, path in builds:
+                stats_file = (os.path.join(work_dir, name + ".json")
+                              if stats[name] else None)
+                rows[name] = measure(path, source, args, stats_file)
+
+            print("%s=%s" % (args.vary, size))
+            for key in ["wall", "peak_rss_mib"] + PHASES:
+                values = [rows[name].get(key) for name, _ in builds]
+                if None in values:
+                    continue
+                old, new = values
+                unit = "MiB" if key == "peak_rss_mib" else "s"
+                print("  %-13s %10.3f%s -> %10.3f%s  (%+.1f%%)"
+                      % (key, old, unit, new, unit,
+                         100 * (new - old) / old if old else 0))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,208 @@
+// monty_gen - writes synthetic Monty programs of configurable size and shape,
+// used to measure how montyc scales with its input. The output only depends
+// on the options and the seed. Programs with a random call graph may take
+// exponential time to run; they are meant to be compiled.
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace cl = llvm::cl;
+
+enum class CallGraph { Chain, Tree, Random };
+
+static cl::opt<unsigned> numFunctions("functions", cl::init(1000),
+                                      cl::desc("Number of functions"));
+static cl::opt<unsigned> numParams("params", cl::init(2),
+                                   cl::desc("Parameters of every function"));
+static cl::opt<CallGraph> callGraph(
+    "call-graph", cl::init(CallGraph::Chain),
+    cl::desc("Shape of the call graph"),
+    cl::values(clEnumValN(CallGraph::Chain, "chain",
+                          "every function calls the one before it"),
+               clEnumValN(CallGraph::Tree, "tree",
+                          "every function calls its --fanout children"),
+               clEnumValN(CallGraph::Random, "random",
+                          "every function calls --fanout earlier ones")));
+static cl::opt<unsigned> fanout("fanout", cl::init(2),
+                                cl::desc("Callees per function for the tree "
+                                         "and random call graphs"));
+static cl::opt<unsigned> exprDepth("depth", cl::init(4),
+                                   cl::desc("Depth of every expression"));
+static cl::opt<unsigned> letDepth("let-depth", cl::init(1),
+                                  cl::desc("Nested `let` expressions in "
+                                           "every function body"));
+static cl::opt<unsigned>
+    numOperators("operators", cl::init(8),
+                 cl::desc("User-defined binary operators"));
+static cl::opt<unsigned> seed("seed", cl::init(1),
+                              cl::desc("Seed of the random choices"));
+static cl::opt<std::string> output("o", cl::init("-"),
+                                   cl::desc("Output file (default stdout)"),
+                                   cl::value_desc("path"));
+
+namespace {
+
+// Characters user-defined operators are spelled with. The built-in operators
+// (`=`, `<`, `+`, `-`, `*`) are left out so no spelling clashes with them.
+constexpr llvm::StringLiteral operatorChars = "|&^%@$~?!>:/";
+
+class Generator {
+public:
+  explicit Generator(llvm::raw_ostream &os)
+      : os(os), random(seed.getValue()) {}
+
+  void run() {
+    this->os << "# Generated by monty_gen: " << numFunctions
+             << " functions, depth " << exprDepth << ", let depth "
+             << letDepth << ", " << numOperators << " operators\n"
+             << "using printd(x);\n\n";
+
+    for (unsigned i = 0; i < numOperators; ++i)
+      emitOperator(i);
+
+    // Callees are always defined before their callers
+    unsigned root = 0;
+    if (callGraph == CallGraph::Tree) {
+      for (unsigned i = numFunctions; i-- > 0;)
+        emitFunction(i, getChildren(i));
+    } else {
+      for (unsigned i = 0; i < numFunctions; ++i)
+        emitFunction(i, getEarlierCallees(i));
+      root = numFunctions ? numFunctions - 1 : 0;
+    }
+
+    this->os << "fn entry()\n  ";
+    if (numFunctions)
+      this->os << "printd(f" << root << "(" << getArgs() << "));\n";
+    else
+      this->os << "0;\n";
+  }
+
+private:
+  llvm::raw_ostream &os;
+  std::mt19937 random;
+  std::vector<std::string> operators;
+  std::vector<std::string> variables;
+
+  // Uniform in [0, bound), the same on every standard library
+  unsigned choose(unsigned bound) { return bound ? random() % bound : 0; }
+
+  // Single characters first, then every pair of them and so on
+  static std::string getSpelling(unsigned index) {
+    std::string spelling;
+    unsigned count = operatorChars.size();
+    do {
+      spelling += operatorChars[index % count];
+      index /= count;
+    } while (index-- > 0);
+    return spelling;
+  }
+
+  void emitOperator(unsigned index) {
+    std::string spelling = getSpelling(index);
+    unsigned precedence = 5 + choose(50);
+    this->os << "fn binary" << spelling << " " << precedence
+             << (choose(2) ? " right" : "") << " (LHS RHS)\n"
+             << "  LHS * 0.5 + RHS;\n\n";
+    this->operators.push_back(std::move(spelling));
+  }
+
+  std::vector<unsigned> getChildren(unsigned index) const {
+    std::vector<unsigned> children;
+    for (unsigned i = 1; i <= fanout; ++i) {
+      uint64_t child = uint64_t(index) * fanout + i;
+      if (child < numFunctions)
+        children.push_back(child);
+    }
+    return children;
+  }
+
+  std::vector<unsigned> getEarlierCallees(unsigned index) {
+    if (index == 0)
+      return {};
+    if (callGraph == CallGraph::Chain)
+      return {index - 1};
+
+    std::vector<unsigned> callees;
+    for (unsigned i = 0; i < fanout; ++i)
+      callees.push_back(choose(index));
+    return callees;
+  }
+
+  std::string getArgs() {
+    std::string args;
+    for (unsigned i = 0; i < numParams; ++i) {
+      if (i)
+        args += ", ";
+      args += getLeaf();
+    }
+    return args;
+  }
+
+  std::string getLeaf() {
+    if (this->variables.empty() || choose(3) == 0)
+      return std::to_string(choose(100)) + ".5";
+    return this->variables[choose(this->variables.size())];
+  }
+
+  std::string getExpr(unsigned depth) {
+    if (depth == 0)
+      return getLeaf();
+
+    static const char *const builtins[] = {"+", "-", "*", "<"};
+    unsigned kind = choose(10);
+    if (kind == 0)
+      return "(if " + getExpr(depth - 1) + " then " + getExpr(depth - 1) +
+             " else " + getExpr(depth - 1) + ")";
+
+    std::string op;
+    if (kind < 4 && !this->operators.empty())
+      op = this->operators[choose(this->operators.size())];
+    else
+      op = builtins[choose(4)];
+    return "(" + getExpr(depth - 1) + " " + op + " " + getExpr(depth - 1) +
+           ")";
+  }
+
+  void emitFunction(unsigned index, const std::vector<unsigned> &callees) {
+    this->variables.clear();
+    this->os << "fn f" << index << "(";
+    for (unsigned i = 0; i < numParams; ++i) {
+      this->variables.push_back("a" + std::to_string(i));
+      this->os << (i ? " " : "") << this->variables.back();
+    }
+    this->os << ")\n";
+
+    for (unsigned i = 0; i < letDepth; ++i) {
+      std::string init = getExpr(exprDepth);
+      this->variables.push_back("v" + std::to_string(i));
+      this->os << "  let " << this->variables.back() << " = " << init
+               << " in\n";
+    }
+
+    this->os << "  " << getExpr(exprDepth);
+    for (unsigned callee : callees)
+      this->os << "\n    + f" << callee << "(" << getArgs() << ")";
+    this->os << ";\n\n";
+  }
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Monty program generator\n");
+
+  std::error_code EC;
+  llvm::raw_fd_ostream os(output, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    llvm::errs() << "Could not open file " << output << ": " << EC.message()
+                 << "\n";
+    return 1;
+  }
+  Generator(os).run();
+  return 0;
+}
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Measures how montyc scales with the size of its input.
+
+Generates programs of increasing size with monty_gen, compiles each of them
+with montyc --stats-json and writes the total and per-phase compile times and
+the peak memory use to a CSV file. When matplotlib is available both are also
+plotted against the size. The growth exponent printed for every column is the
+slope of a log-log fit: about 1 for linear behaviour, about 2 for quadratic.
+"""
+
+import argparse
+import csv
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+PHASES = ["parse", "fold", "irgen", "verify", "optimize", "codegen", "link"]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--montyc", required=True, help="path to montyc")
+    parser.add_argument("--gen", required=True, help="path to monty_gen")
+    parser.add_argument("--vary", default="functions",
+                        choices=["functions", "depth", "let-depth",
+                                 "operators", "fanout"],
+                        help="monty_gen option that is scaled")
+    parser.add_argument("--sizes", default="1000,2000,4000,8000,16000",
+                        help="comma separated values of the scaled option")
+    parser.add_argument("--opt", default="0", help="optimization level")
+    parser.add_argument("-j", dest="jobs", default="1",
+                        help="montyc worker threads")
+    parser.add_argument("--compile-only", action="store_true",
+                        help="pass -c to montyc, skipping the link")
+    parser.add_argument("--out", default="scaling",
+                        help="prefix of the .csv and .png files written")
+    parser.add_argument("gen_args", nargs=argparse.REMAINDER,
+                        help="further monty_gen options, after --")
+    return parser.parse_args()
+
+
+def measure(args, size, work_dir):
+    source = os.path.join(work_dir, "gen-%s.my" % size)
+    output = os.path.join(work_dir, "gen-%s" % size)
+    stats_file = output + ".json"
+
+    gen_args = [a for a in args.gen_args if a != "--"]
+    subprocess.run([args.gen, "--%s=%s" % (args.vary, size), "-o", source]
+                   + gen_args, check=True)
+    command = [args.montyc, source, "-O" + args.opt, "-j", args.jobs,
+               "-o", output, "--stats-json=" + stats_file]
+    if args.compile_only:
+        command.append("-c")
+    subprocess.run(command, check=True)
+
+    with open(stats_file) as f:
+        stats = json.load(f)
+    row = {"size": int(size), "source_bytes": os.path.getsize(source),
+           "total": stats["total"]["wall"],
+           "peak_rss_mib": stats["peak_rss_bytes"] / (1 << 20)}
+    for phase in PHASES:
+        row[phase] = stats["phases"][phase]["wall"]
+    return row
+
+
+def growth_exponent(rows, column):
+    points = [(math.log(r["size"]), math.log(r[column]))
+              for r in rows if r["size"] > 0 and r[column] > 0]
+    if len(points) < 2:
+        return None
+    mean_x = sum(x for x, _ in points) / len(points)
+    mean_y = sum(y for _, y in points) / len(points)
+    var = sum((x - mean_x) ** 2 for x, _ in points)
+    if var == 0:
+        return None
+    return sum((x - mean_x) * (y - mean_y) for x, y in points) / var
+
+
+def plot(args, rows):
+    try:
+        import matplotlib
+        matplotlib.use("Agg")
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print("matplotlib not found, skipping the plot", file=sys.stderr)
+        return
+
+    sizes = [r["size"] for r in rows]
+    fig, (times, memory) = plt.subplots(1, 2, figsize=(12, 5))
+    for column in ["total"] + PHASES:
+        times.plot(sizes, [r[column] for r in rows], marker="o",
+                   label=column)
+    times.set_xlabel(args.vary)
+    times.set_ylabel("wall time (s)")
+    times.legend()
+    memory.plot(sizes, [r["peak_rss_mib"] for r in rows], marker="o")
+    memory.set_xlabel(args.vary)
+    memory.set_ylabel("peak RSS (MiB)")
+    fig.suptitle("montyc -O%s, scaling --%s" % (args.opt, args.vary))
+    fig.tight_layout()
+    fig.savefig(args.out + ".png")
+    print("wrote " + args.out + ".png")
+
+
+def main():
+    args = parse_args()
+    rows = []
+    with tempfile.TemporaryDirectory(prefix="monty-scaling") as work_dir:
+        for size in args.sizes.split(","):
+            row = measure(args, size.strip(), work_dir)
+            print("%s=%-8d total %8.3fs  peak %8.1f MiB"
+                  % (args.vary, row["size"], row["total"],
+                     row["peak_rss_mib"]))
+            rows.append(row)
+
+    with open(args.out + ".csv", "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=list(rows[0].keys()))
+        writer.writeheader()
+        writer.writerows(rows)
+    print("wrote " + args.out + ".csv")
+
+    for column in ["total"] + PHASES + ["peak_rss_mib"]:
+        exponent = growth_exponent(rows, column)
+        if exponent is not None:
+            print("%-13s grows as size^%.2f" % (column, exponent))
+    plot(args, rows)
+
+
+if __name__ == "__main__":
+    main()